@@ -16,6 +16,9 @@
  */
 
 #include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 
 #if defined(SUPPORT_LZO2)
@@ -31,6 +34,11 @@
 #include <lzma.h>
 #endif /* SUPPORT LZMA */
 
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#define SHRINK_X86_64
+#include <immintrin.h>
+#endif /* __x86_64__ */
+
 #include <shrink.h>
 
 #ifdef BUILDSTR
@@ -46,7 +54,33 @@ struct shrink_ctx {
 		    size_t, size_t *);
 	int	(*s_decompress)(struct shrink_ctx *, uint8_t *, uint8_t *,
 		    size_t, size_t *);
+	int	(*s_decompress_grow)(struct shrink_ctx *, uint8_t *, size_t,
+		    uint8_t **, size_t *, size_t *);
 	size_t	(*s_compress_bounds)(struct shrink_ctx *, size_t);
+	size_t	(*s_inplace_margin)(struct shrink_ctx *, size_t);
+	void	(*s_memusage)(struct shrink_ctx *, uint64_t *, uint64_t *);
+	int	(*s_memfit)(struct shrink_ctx *, uint64_t);
+	uint64_t	s_memlimit;	/* 0 when unlimited */
+	int	s_csum;
+	int	s_filter;
+	int	s_stride;
+	uint8_t	*s_scratch;	/* filter buffer */
+	size_t	s_scratchsz;
+	int	s_chain;	/* backend takes a preset dictionary */
+	size_t	s_histmax;	/* 0 when history is off */
+	int	s_keyint;
+	uint64_t	s_nblocks;	/* since the last reset */
+	uint8_t	*s_hist;	/* tail of the previous blocks */
+	size_t	s_histlen;
+	const uint8_t	*s_dict;	/* history for the current block */
+	size_t	s_dictlen;
+#if defined(SUPPORT_LZW)
+	int	s_wbits;
+	int	s_memlevel;
+#endif /* SUPPORT_LZW */
+#if defined(SUPPORT_LZMA)
+	uint32_t	s_dictsz;	/* 0 for the preset size */
+#endif /* SUPPORT_LZMA */
 #if defined(SUPPORT_LZO2)
 	lzo_uint32	s_lzo1x_heapsz;
 
@@ -55,6 +89,60 @@ struct shrink_ctx {
 #endif /* defined(SUPPORT_lZO2) */
 };
 
+/*
+ * Buffer pool.  Buffers are rounded up to a size class and kept on a small
+ * per class free stack so that callers that allocate and free the same block
+ * sizes over and over do not keep page faulting fresh memory in.  Classes are
+ * powers of two up to the huge page size, multiples of it up to 16MB and
+ * eight steps per doubling above that, so multi megabyte blocks waste at most
+ * a huge page or an eighth.  Pools are not locked; use one per thread.
+ */
+#define SHRINK_POOL_MINSHIFT	(12)	/* 4KB */
+#define SHRINK_POOL_POW2	(10)	/* 4KB to 2MB */
+#define SHRINK_POOL_LINEAR	(7)	/* 4MB to 16MB in 2MB steps */
+#define SHRINK_POOL_STEPSHIFT	(24)	/* 16MB */
+#define SHRINK_POOL_STEPS	(8)	/* classes per doubling */
+#define SHRINK_POOL_MAXSHIFT	(40)	/* 1TB */
+#define SHRINK_POOL_CLASSES	(SHRINK_POOL_POW2 + SHRINK_POOL_LINEAR + \
+				SHRINK_POOL_STEPS * \
+				(SHRINK_POOL_MAXSHIFT - SHRINK_POOL_STEPSHIFT))
+#define SHRINK_POOL_DEPTH	(8)	/* cached buffers per class */
+#define SHRINK_HUGE_SZ		(2 * 1024 * 1024)
+
+/*
+ * Blocks carry a small header when any per block option (e.g. a checksum) is
+ * enabled on the context.  All fields are little endian.
+ *
+ *	0	magic
+ *	1	version
+ *	2	checksum type
+ *	3	filter
+ *	4	filter stride
+ *	5-7	bytes of history the block was compressed against, 0 if none
+ *	8-15	checksum of the uncompressed data
+ */
+#define SHRINK_HDR_SZ		(16)
+#define SHRINK_HDR_MAGIC	(0xa7)
+#define SHRINK_HDR_VERSION	(1)
+
+struct shrink_hdr {
+	int		sh_csum;
+	int		sh_filter;
+	int		sh_stride;
+	size_t		sh_hist;
+	uint64_t	sh_sum;
+};
+
+struct shrink_pool {
+	size_t		sp_align;
+	size_t		sp_pagesz;
+	int		sp_flags;
+	struct {
+		void	*sc_free[SHRINK_POOL_DEPTH];
+		int	sc_count;
+	}		sp_class[SHRINK_POOL_CLASSES];
+};
+
 const char *
 shrink_verstring(void)
 {
@@ -69,6 +157,27 @@ shrink_version(int *major, int *minor, int *patch)
 	*patch = SHRINK_VERSION_PATCH;
 }
 
+/*
+ * Grow a decompression buffer for shrink_decompress_alloc.  Data already
+ * in the buffer is preserved.
+ */
+static int
+s_grow(uint8_t **buf, size_t *bufsz)
+{
+	uint8_t			*p;
+	size_t			nsz;
+
+	nsz = *bufsz * 2;
+	if (nsz <= *bufsz)
+		return (SHRINK_LIBC);
+	if ((p = realloc(*buf, nsz)) == NULL)
+		return (SHRINK_LIBC);
+	*buf = p;
+	*bufsz = nsz;
+
+	return (SHRINK_OK);
+}
+
 /* null compression */
 size_t
 s_compress_bounds_null(struct shrink_ctx *ctx, size_t sz)
@@ -76,6 +185,25 @@ s_compress_bounds_null(struct shrink_ctx *ctx, size_t sz)
 	return (sz);
 }
 
+/* bcopy handles the overlap */
+size_t
+s_inplace_margin_null(struct shrink_ctx *ctx, size_t sz)
+{
+	return (0);
+}
+
+void
+s_memusage_null(struct shrink_ctx *ctx, uint64_t *enc, uint64_t *dec)
+{
+	*enc = *dec = 0;
+}
+
+int
+s_memfit_null(struct shrink_ctx *ctx, uint64_t limit)
+{
+	return (SHRINK_OK);
+}
+
 int
 s_compress_null(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst, size_t len,
     size_t *comp_sz)
@@ -98,6 +226,17 @@ s_decompress_null(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
 	return (SHRINK_OK);
 }
 
+int
+s_decompress_grow_null(struct shrink_ctx *ctx, uint8_t *src, size_t len,
+    uint8_t **dst, size_t *dstsz, size_t *uncomp_sz)
+{
+	while (*dstsz < len)
+		if (s_grow(dst, dstsz))
+			return (SHRINK_LIBC);
+
+	return (s_decompress_null(ctx, src, *dst, len, uncomp_sz));
+}
+
 #if defined(SUPPORT_LZO2)
 /* LZO */
 #define HEAP_ALLOC(var,size) \
@@ -133,6 +272,33 @@ s_compress_bounds_lzo(struct shrink_ctx *ctx, size_t sz)
 	return (LZO_SIZE(sz));
 }
 
+/*
+ * From the LZO overlap.c example: in-place decompression needs the
+ * compressed data to end this many bytes past the uncompressed data.
+ */
+size_t
+s_inplace_margin_lzo(struct shrink_ctx *ctx, size_t sz)
+{
+	return ((sz / 16) + 64 + 3);
+}
+
+/* the work memory lives on the stack, decompression needs none */
+void
+s_memusage_lzo(struct shrink_ctx *ctx, uint64_t *enc, uint64_t *dec)
+{
+	*enc = ctx->s_lzo1x_heapsz;
+	*dec = 0;
+}
+
+/* fixed per level, nothing to shrink */
+int
+s_memfit_lzo(struct shrink_ctx *ctx, uint64_t limit)
+{
+	if (limit && ctx->s_lzo1x_heapsz > limit)
+		return (SHRINK_MEMLIMIT);
+	return (SHRINK_OK);
+}
+
 int
 s_compress_lzo(struct shrink_ctx *ctx,  uint8_t *src, uint8_t *dst, size_t len,
     size_t *comp_sz)
@@ -159,20 +325,186 @@ s_decompress_lzo(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
 		return (SHRINK_LIB_COMPRESS);
 	return (SHRINK_OK);
 }
+
+/*
+ * LZO has no streaming decoder so this is the one backend that has to start
+ * over with a bigger buffer when the output does not fit.
+ */
+int
+s_decompress_grow_lzo(struct shrink_ctx *ctx, uint8_t *src, size_t len,
+    uint8_t **dst, size_t *dstsz, size_t *uncomp_sz)
+{
+	lzo_uint		out;
+	int			r;
+
+	for (;;) {
+		out = *dstsz;
+		r = lzo1x_decompress_safe(src, len, *dst, &out, NULL);
+		if (r == LZO_E_OK)
+			break;
+		if (r != LZO_E_OUTPUT_OVERRUN)
+			return (SHRINK_LIB_COMPRESS);
+		if (s_grow(dst, dstsz))
+			return (SHRINK_LIBC);
+	}
+	*uncomp_sz = out;
+
+	return (SHRINK_OK);
+}
 #endif /* SUPPORT_LZO2 */
 
 #if defined(SUPPORT_LZW)
 /* LZW */
+#define LZW_WBITS	(15)	/* zlib defaults */
+#define LZW_MEMLEVEL	(8)
+
+/* from zconf.h, plus the deflate state */
+#define LZW_ENC_MEM(w, m)	((1ULL << ((w) + 2)) + (1ULL << ((m) + 9)) + \
+				    6 * 1024)
+#define LZW_DEC_MEM(w)		((1ULL << (w)) + 1440 * 2 * sizeof(int))
+
+/* whether the zlib one shot functions can be used */
+static int
+s_defaults_lzw(struct shrink_ctx *ctx)
+{
+	return (ctx->s_wbits == LZW_WBITS && ctx->s_memlevel == LZW_MEMLEVEL);
+}
+
 size_t
 s_compress_bounds_lzw(struct shrink_ctx *ctx, size_t sz)
 {
-	return (compressBound(sz));
+	size_t			dictid;
+
+	/* a preset dictionary adds its adler32 to the zlib header */
+	dictid = ctx->s_histmax ? 4 : 0;
+
+	/* small windows emit more blocks, deflateBound's generic bound */
+	if (!s_defaults_lzw(ctx))
+		return (sz + ((sz + 7) >> 3) + ((sz + 63) >> 6) + 5 + 6 +
+		    dictid);
+	return (compressBound(sz) + dictid);
+}
+
+/*
+ * Worst case expansion of any tail of the stream plus one stored block,
+ * which inflate copies with memcpy and therefore must not overlap.
+ */
+size_t
+s_inplace_margin_lzw(struct shrink_ctx *ctx, size_t sz)
+{
+	return (s_compress_bounds_lzw(ctx, sz) - sz + 65535);
+}
+
+/* deflate never looks back further than its 32KB window */
+static uInt
+s_dict_lzw(struct shrink_ctx *ctx, const Bytef **dict)
+{
+	size_t			n;
+
+	n = ctx->s_dictlen < 32768 ? ctx->s_dictlen : 32768;
+	*dict = ctx->s_dict + ctx->s_dictlen - n;
+
+	return (n);
+}
+
+void
+s_memusage_lzw(struct shrink_ctx *ctx, uint64_t *enc, uint64_t *dec)
+{
+	*enc = LZW_ENC_MEM(ctx->s_wbits, ctx->s_memlevel);
+	*dec = LZW_DEC_MEM(ctx->s_wbits);
+}
+
+/* shrink the window and hash table together, like zlib's defaults do */
+int
+s_memfit_lzw(struct shrink_ctx *ctx, uint64_t limit)
+{
+	int			w = LZW_WBITS, m = LZW_MEMLEVEL;
+
+	while (limit && (LZW_ENC_MEM(w, m) > limit ||
+	    LZW_DEC_MEM(w) > limit)) {
+		if (w == 9)
+			return (SHRINK_MEMLIMIT);
+		w--;
+		m = w - 7;
+	}
+	ctx->s_wbits = w;
+	ctx->s_memlevel = m;
+
+	return (SHRINK_OK);
+}
+
+/*
+ * Streams from a context with a bigger window can not be inflated in a
+ * smaller one; tell the caller that rather than returning a zlib error.
+ */
+static int
+s_window_lzw(struct shrink_ctx *ctx, const uint8_t *src, size_t len)
+{
+	if (len > 0 && (src[0] >> 4) + 8 > ctx->s_wbits)
+		return (SHRINK_MEMLIMIT);
+	return (SHRINK_OK);
+}
+
+/* zlib stream with a preset dictionary or a reduced window */
+static int
+s_deflate_lzw(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
+    size_t len, size_t *comp_sz)
+{
+	z_stream		z;
+	const Bytef		*dict;
+	uInt			dictlen;
+
+	bzero(&z, sizeof(z));
+	if (deflateInit2(&z, ctx->s_level, Z_DEFLATED, ctx->s_wbits,
+	    ctx->s_memlevel, Z_DEFAULT_STRATEGY) != Z_OK)
+		return (SHRINK_LIB_COMPRESS);
+	dictlen = s_dict_lzw(ctx, &dict);
+	if (dictlen && deflateSetDictionary(&z, dict, dictlen) != Z_OK) {
+		deflateEnd(&z);
+		return (SHRINK_LIB_COMPRESS);
+	}
+
+	z.next_in = src;
+	z.avail_in = len;
+	z.next_out = dst;
+	z.avail_out = *comp_sz;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&z);
+		return (SHRINK_LIB_COMPRESS);
+	}
+	*comp_sz = z.total_out;
+	deflateEnd(&z);
+
+	return (SHRINK_OK);
+}
+
+/* returns the inflate result after supplying the dictionary if needed */
+static int
+s_inflate_lzw(struct shrink_ctx *ctx, z_stream *z)
+{
+	const Bytef		*dict;
+	uInt			dictlen;
+	int			r;
+
+	r = inflate(z, Z_FINISH);
+	if (r == Z_NEED_DICT) {
+		dictlen = s_dict_lzw(ctx, &dict);
+		if (ctx->s_dictlen == 0 ||
+		    inflateSetDictionary(z, dict, dictlen) != Z_OK)
+			return (Z_DATA_ERROR);
+		r = inflate(z, Z_FINISH);
+	}
+
+	return (r);
 }
 
 int
 s_compress_lzw(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst, size_t len,
     size_t *comp_sz)
 {
+	if (ctx->s_dictlen || !s_defaults_lzw(ctx))
+		return (s_deflate_lzw(ctx, src, dst, len, comp_sz));
+
 	if (compress2(dst, (uLongf *)comp_sz, src, len,
 	   ctx->s_level) != Z_OK)
 		return (SHRINK_LIB_COMPRESS);
@@ -183,9 +515,70 @@ int
 s_decompress_lzw(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
     size_t len, size_t *uncomp_sz)
 {
+	z_stream		z;
 
-	if (uncompress(dst, (uLongf *) uncomp_sz, src, len) != Z_OK)
+	if (ctx->s_dictlen == 0 && s_defaults_lzw(ctx)) {
+		if (uncompress(dst, (uLongf *) uncomp_sz, src, len) != Z_OK)
+			return (SHRINK_LIB_COMPRESS);
+		return (SHRINK_OK);
+	}
+
+	if (s_window_lzw(ctx, src, len))
+		return (SHRINK_MEMLIMIT);
+	bzero(&z, sizeof(z));
+	if (inflateInit2(&z, ctx->s_wbits) != Z_OK)
+		return (SHRINK_LIB_COMPRESS);
+	z.next_in = src;
+	z.avail_in = len;
+	z.next_out = dst;
+	z.avail_out = *uncomp_sz;
+	if (s_inflate_lzw(ctx, &z) != Z_STREAM_END) {
+		inflateEnd(&z);
+		return (SHRINK_LIB_COMPRESS);
+	}
+	*uncomp_sz = z.total_out;
+	inflateEnd(&z);
+
+	return (SHRINK_OK);
+}
+
+int
+s_decompress_grow_lzw(struct shrink_ctx *ctx, uint8_t *src, size_t len,
+    uint8_t **dst, size_t *dstsz, size_t *uncomp_sz)
+{
+	z_stream		z;
+	int			r;
+
+	if (s_window_lzw(ctx, src, len))
+		return (SHRINK_MEMLIMIT);
+	bzero(&z, sizeof(z));
+	if (inflateInit2(&z, ctx->s_wbits) != Z_OK)
 		return (SHRINK_LIB_COMPRESS);
+
+	z.next_in = src;
+	z.avail_in = len;
+	z.next_out = *dst;
+	z.avail_out = *dstsz;
+	for (;;) {
+		r = s_inflate_lzw(ctx, &z);
+		if (r == Z_STREAM_END)
+			break;
+		/* anything but running out of room is fatal */
+		if ((r != Z_OK && r != Z_BUF_ERROR) || z.avail_out != 0) {
+			inflateEnd(&z);
+			return (SHRINK_LIB_COMPRESS);
+		}
+		if (s_grow(dst, dstsz)) {
+			inflateEnd(&z);
+			return (SHRINK_LIBC);
+		}
+		/* pick up where we left off in the new buffer */
+		z.next_out = *dst + z.total_out;
+		z.avail_out = *dstsz - z.total_out;
+	}
+	*uncomp_sz = z.total_out;
+	inflateEnd(&z);
+
 	return (SHRINK_OK);
 }
 #endif /* SUPPORT_LZW */
@@ -201,6 +594,127 @@ s_compress_bounds_lzma(struct shrink_ctx *ctx, size_t sz)
 	return (LZMA_SIZE(sz));
 }
 
+/* an LZMA2 chunk carries at most 64KB behind a header of up to 6 bytes */
+#define LZMA2_CHUNK_MAX	(65536 + 6)
+
+/*
+ * Worst case expansion of any tail of the stream plus one LZMA2 chunk, which
+ * the decoder may consume and emit as a whole.
+ */
+size_t
+s_inplace_margin_lzma(struct shrink_ctx *ctx, size_t sz)
+{
+	return (LZMA_SIZE(sz) - sz + LZMA2_CHUNK_MAX);
+}
+
+/*
+ * The .xz container has no room for a preset dictionary so blocks chained to
+ * the history are raw LZMA2 with the options of the preset level.  The block
+ * header tells the decoder which one it is looking at.
+ */
+static void
+s_chain_lzma(struct shrink_ctx *ctx, lzma_options_lzma *opt,
+    lzma_filter *filters)
+{
+	opt->preset_dict = ctx->s_dict;
+	opt->preset_dict_size = ctx->s_dictlen;
+	if (ctx->s_dictsz)
+		opt->dict_size = ctx->s_dictsz;
+	filters[0].id = LZMA_FILTER_LZMA2;
+	filters[0].options = opt;
+	filters[1].id = LZMA_VLI_UNKNOWN;
+	filters[1].options = NULL;
+}
+
+static int
+s_encoder_lzma(struct shrink_ctx *ctx, lzma_stream *lzma)
+{
+	lzma_options_lzma	opt;
+	lzma_filter		filters[2];
+
+	if (ctx->s_dictlen == 0 && ctx->s_dictsz == 0)
+		return (lzma_easy_encoder(lzma, ctx->s_level,
+		    LZMA_CHECK_CRC32));
+	if (lzma_lzma_preset(&opt, ctx->s_level))
+		return (LZMA_OPTIONS_ERROR);
+	s_chain_lzma(ctx, &opt, filters);
+	if (ctx->s_dictlen == 0)
+		return (lzma_stream_encoder(lzma, filters, LZMA_CHECK_CRC32));
+
+	return (lzma_raw_encoder(lzma, filters));
+}
+
+/*
+ * The dictionary size of an .xz stream is in its headers, so the limit only
+ * has to guard against streams that need more than the caller allows.
+ */
+static int
+s_decoder_lzma(struct shrink_ctx *ctx, lzma_stream *lzma)
+{
+	lzma_options_lzma	opt;
+	lzma_filter		filters[2];
+
+	/* the history buffer is part of the limit, set_memlimit checked it */
+	if (ctx->s_dictlen == 0)
+		return (lzma_auto_decoder(lzma, ctx->s_memlimit ?
+		    ctx->s_memlimit - ctx->s_histmax : UINT64_MAX, 0));
+	if (lzma_lzma_preset(&opt, ctx->s_level))
+		return (LZMA_OPTIONS_ERROR);
+	s_chain_lzma(ctx, &opt, filters);
+
+	return (lzma_raw_decoder(lzma, filters));
+}
+
+void
+s_memusage_lzma(struct shrink_ctx *ctx, uint64_t *enc, uint64_t *dec)
+{
+	lzma_options_lzma	opt;
+	lzma_filter		filters[2];
+
+	if (ctx->s_dictsz == 0) {
+		*enc = lzma_easy_encoder_memusage(ctx->s_level);
+		*dec = lzma_easy_decoder_memusage(ctx->s_level);
+		return;
+	}
+	lzma_lzma_preset(&opt, ctx->s_level);
+	s_chain_lzma(ctx, &opt, filters);
+	*enc = lzma_raw_encoder_memusage(filters);
+	*dec = lzma_raw_decoder_memusage(filters);
+}
+
+/*
+ * Halve the dictionary until both the encoder and the decoder fit; limit
+ * is what is left after the history buffer.
+ */
+int
+s_memfit_lzma(struct shrink_ctx *ctx, uint64_t limit)
+{
+	lzma_options_lzma	opt;
+	lzma_filter		filters[2];
+
+	if (lzma_lzma_preset(&opt, ctx->s_level))
+		return (SHRINK_LIB_COMPRESS);
+	if (limit == 0 || (lzma_easy_encoder_memusage(ctx->s_level) <= limit &&
+	    lzma_easy_decoder_memusage(ctx->s_level) <= limit)) {
+		ctx->s_dictsz = 0;
+		return (SHRINK_OK);
+	}
+
+	filters[0].id = LZMA_FILTER_LZMA2;
+	filters[0].options = &opt;
+	filters[1].id = LZMA_VLI_UNKNOWN;
+	filters[1].options = NULL;
+	while (lzma_raw_encoder_memusage(filters) > limit ||
+	    lzma_raw_decoder_memusage(filters) > limit) {
+		if (opt.dict_size / 2 < LZMA_DICT_SIZE_MIN)
+			return (SHRINK_MEMLIMIT);
+		opt.dict_size /= 2;
+	}
+	ctx->s_dictsz = opt.dict_size;
+
+	return (SHRINK_OK);
+}
+
 int
 s_compress_lzma(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
     size_t len, size_t *comp_sz)
@@ -212,8 +726,7 @@ s_compress_lzma(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
 	lzma.next_out = dst;
 	lzma.avail_in = len;
 	lzma.avail_out = *comp_sz;
-	if (lzma_easy_encoder(&lzma, ctx->s_level,
-	    LZMA_CHECK_CRC32) != LZMA_OK) {
+	if (s_encoder_lzma(ctx, &lzma) != LZMA_OK) {
 		lzma_end(&lzma);
 		return (SHRINK_LIB_COMPRESS);
 	}
@@ -248,16 +761,55 @@ s_decompress_lzma(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
 	lzma.next_out = dst;
 	lzma.avail_in = len;
 	lzma.avail_out = *uncomp_sz;
-	if ((r = lzma_auto_decoder(&lzma,
-	    lzma_easy_decoder_memusage(ctx->s_level), 0)) != LZMA_OK) {
+	if ((r = s_decoder_lzma(ctx, &lzma)) != LZMA_OK) {
 		lzma_end(&lzma);
 		return (SHRINK_LIB_COMPRESS);
 	}
 	r = lzma_code(&lzma, LZMA_RUN);
 	if (r != LZMA_STREAM_END) {
+		lzma_end(&lzma);
+		return (r == LZMA_MEMLIMIT_ERROR ? SHRINK_MEMLIMIT :
+		    SHRINK_LIB_COMPRESS);
+	}
+	*uncomp_sz = lzma.total_out;
+	lzma_end(&lzma);
+
+	return (SHRINK_OK);
+}
+
+int
+s_decompress_grow_lzma(struct shrink_ctx *ctx, uint8_t *src, size_t len,
+    uint8_t **dst, size_t *dstsz, size_t *uncomp_sz)
+{
+	lzma_stream		lzma = LZMA_STREAM_INIT;
+	int			r;
+
+	if (s_decoder_lzma(ctx, &lzma) != LZMA_OK) {
 		lzma_end(&lzma);
 		return (SHRINK_LIB_COMPRESS);
 	}
+
+	lzma.next_in = src;
+	lzma.avail_in = len;
+	lzma.next_out = *dst;
+	lzma.avail_out = *dstsz;
+	for (;;) {
+		r = lzma_code(&lzma, LZMA_FINISH);
+		if (r == LZMA_STREAM_END)
+			break;
+		if (r != LZMA_OK || lzma.avail_out != 0) {
+			lzma_end(&lzma);
+			return (r == LZMA_MEMLIMIT_ERROR ? SHRINK_MEMLIMIT :
+			    SHRINK_LIB_COMPRESS);
+		}
+		if (s_grow(dst, dstsz)) {
+			lzma_end(&lzma);
+			return (SHRINK_LIBC);
+		}
+		/* the decoder keeps its state, continue in the new buffer */
+		lzma.next_out = *dst + lzma.total_out;
+		lzma.avail_out = *dstsz - lzma.total_out;
+	}
 	*uncomp_sz = lzma.total_out;
 	lzma_end(&lzma);
 
@@ -265,53 +817,971 @@ s_decompress_lzma(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
 }
 #endif /* SUPPORT_LZMA */
 
-struct shrink_ctx *
-shrink_init(int algorithm, int level)
+/* checksums */
+static const uint32_t crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4,
+	0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+	0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54,
+	0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5,
+	0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45,
+	0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48,
+	0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687,
+	0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8,
+	0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+	0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9,
+	0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36,
+	0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+	0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3,
+	0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652,
+	0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d,
+	0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2,
+	0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530,
+	0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f,
+	0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+	0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321,
+	0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81,
+	0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static uint64_t
+s_get64le(const uint8_t *p)
 {
-	struct shrink_ctx	*ctx;
+	return ((uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+	    (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	    (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56);
+}
 
-	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
-		return (ctx);
+static uint32_t
+s_get32le(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	    (uint32_t)p[3] << 24);
+}
 
-	switch (algorithm) {
-	case SHRINK_ALG_NULL:
-		if (level != SHRINK_L_NONE)
-			goto fail;
+static void
+s_put64le(uint8_t *p, uint64_t v)
+{
+	int			i;
 
-		ctx->s_algorithm = "null";
-		ctx->s_compress = s_compress_null;
-		ctx->s_decompress = s_decompress_null;
-		ctx->s_compress_bounds = s_compress_bounds_null;
-		ctx->s_level = level;
-		break;
-#if defined(SUPPORT_LZO2)
-	case SHRINK_ALG_LZO:
-		if (lzo_init() != LZO_E_OK)
-			goto fail;
-		switch (level) {
-		case SHRINK_L_MIN:
-			ctx->s_lzo1x_compress = lzo1x_1_compress;
-			ctx->s_lzo1x_heapsz = LZO1X_1_MEM_COMPRESS;
-			ctx->s_algorithm = "lzo1x_1";
-			break;
-		case SHRINK_L_MID:
-			ctx->s_lzo1x_compress = lzo1x_1_15_compress;
-			ctx->s_lzo1x_heapsz = LZO1X_1_15_MEM_COMPRESS;
-			ctx->s_algorithm = "lzo1x_1_15";
-			break;
-		case SHRINK_L_MAX:
-			ctx->s_lzo1x_compress = lzo1x_999_compress;
-			ctx->s_lzo1x_heapsz = LZO1X_999_MEM_COMPRESS;
-			ctx->s_algorithm = "lzo1x_999";
-			break;
-		case SHRINK_L_NONE:
-		default:
-			goto fail;
-		}
-		ctx->s_compress = s_compress_lzo;
-		ctx->s_decompress = s_decompress_lzo;
-		ctx->s_level = level;
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (i * 8);
+}
+
+static uint64_t
+s_crc32c_sw(const uint8_t *p, size_t len)
+{
+	uint32_t		crc = 0xffffffff;
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return (crc ^ 0xffffffff);
+}
+
+#if defined(SHRINK_X86_64)
+__attribute__((target("sse4.2")))
+static uint64_t
+s_crc32c_sse42(const uint8_t *p, size_t len)
+{
+	uint64_t		crc = 0xffffffff;
+
+	for (; len >= 8; p += 8, len -= 8)
+		crc = _mm_crc32_u64(crc, s_get64le(p));
+	for (; len > 0; p++, len--)
+		crc = _mm_crc32_u8(crc, *p);
+
+	return (crc ^ 0xffffffff);
+}
+#endif /* SHRINK_X86_64 */
+
+/* XXH64 by Yann Collet, seed 0 */
+#define XXH_P1	0x9e3779b185ebca87ULL
+#define XXH_P2	0xc2b2ae3d27d4eb4fULL
+#define XXH_P3	0x165667b19e3779f9ULL
+#define XXH_P4	0x85ebca77c2b2ae63ULL
+#define XXH_P5	0x27d4eb2f165667c5ULL
+#define XXH_ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t
+s_xxh64_round(uint64_t acc, uint64_t v)
+{
+	acc += v * XXH_P2;
+	acc = XXH_ROTL(acc, 31);
+	return (acc * XXH_P1);
+}
+
+static uint64_t
+s_xxh64_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= s_xxh64_round(0, v);
+	return (acc * XXH_P1 + XXH_P4);
+}
+
+static uint64_t
+s_xxh64(const uint8_t *p, size_t len)
+{
+	const uint8_t		*end = p + len;
+	uint64_t		h, v1, v2, v3, v4;
+
+	if (len >= 32) {
+		v1 = XXH_P1 + XXH_P2;
+		v2 = XXH_P2;
+		v3 = 0;
+		v4 = -XXH_P1;
+		do {
+			v1 = s_xxh64_round(v1, s_get64le(p));
+			v2 = s_xxh64_round(v2, s_get64le(p + 8));
+			v3 = s_xxh64_round(v3, s_get64le(p + 16));
+			v4 = s_xxh64_round(v4, s_get64le(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+		h = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) +
+		    XXH_ROTL(v4, 18);
+		h = s_xxh64_merge(h, v1);
+		h = s_xxh64_merge(h, v2);
+		h = s_xxh64_merge(h, v3);
+		h = s_xxh64_merge(h, v4);
+	} else
+		h = XXH_P5;
+	h += len;
+
+	for (; end - p >= 8; p += 8) {
+		h ^= s_xxh64_round(0, s_get64le(p));
+		h = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t)s_get32le(p) * XXH_P1;
+		h = XXH_ROTL(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_P5;
+		h = XXH_ROTL(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+
+	return (h);
+}
+
+/* pick the fastest implementation this cpu supports */
+static uint64_t
+s_checksum(int csum, const uint8_t *p, size_t len)
+{
+	switch (csum) {
+	case SHRINK_CSUM_CRC32C:
+#if defined(SHRINK_X86_64)
+		if (__builtin_cpu_supports("sse4.2"))
+			return (s_crc32c_sse42(p, len));
+#endif /* SHRINK_X86_64 */
+		return (s_crc32c_sw(p, len));
+	case SHRINK_CSUM_XXH64:
+		return (s_xxh64(p, len));
+	}
+
+	return (0);
+}
+
+/* BLAKE2b (RFC 7693), unkeyed, SHRINK_DIGEST_LEN bytes of output */
+static const uint64_t s_blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t s_blake2b_sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define B2B_ROTR(x, r)	(((x) >> (r)) | ((x) << (64 - (r))))
+#define B2B_G(v, a, b, c, d, x, y)					\
+	do {								\
+		v[a] += v[b] + (x);					\
+		v[d] = B2B_ROTR(v[d] ^ v[a], 32);			\
+		v[c] += v[d];						\
+		v[b] = B2B_ROTR(v[b] ^ v[c], 24);			\
+		v[a] += v[b] + (y);					\
+		v[d] = B2B_ROTR(v[d] ^ v[a], 16);			\
+		v[c] += v[d];						\
+		v[b] = B2B_ROTR(v[b] ^ v[c], 63);			\
+	} while (0)
+
+static void
+s_blake2b_compress(uint64_t *h, const uint8_t *blk, uint64_t t, int last)
+{
+	const uint8_t		*s;
+	uint64_t		v[16], m[16];
+	int			i, r;
+
+	for (i = 0; i < 16; i++)
+		m[i] = s_get64le(blk + i * 8);
+	for (i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = s_blake2b_iv[i];
+	}
+	v[12] ^= t;		/* high word of the counter is always 0 */
+	if (last)
+		v[14] = ~v[14];
+
+	for (r = 0; r < 12; r++) {
+		s = s_blake2b_sigma[r];
+		B2B_G(v, 0, 4,  8, 12, m[s[0]], m[s[1]]);
+		B2B_G(v, 1, 5,  9, 13, m[s[2]], m[s[3]]);
+		B2B_G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+		B2B_G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+		B2B_G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+		B2B_G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		B2B_G(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+		B2B_G(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] ^= v[i] ^ v[i + 8];
+}
+
+static void
+s_blake2b(uint8_t *out, const uint8_t *p, size_t len)
+{
+	uint64_t		h[8], t = 0;
+	uint8_t			blk[128];
+	int			i;
+
+	memcpy(h, s_blake2b_iv, sizeof(h));
+	h[0] ^= 0x01010000 ^ SHRINK_DIGEST_LEN;
+
+	for (; len > sizeof(blk); p += sizeof(blk), len -= sizeof(blk)) {
+		t += sizeof(blk);
+		s_blake2b_compress(h, p, t, 0);
+	}
+	memset(blk, 0, sizeof(blk));
+	memcpy(blk, p, len);
+	s_blake2b_compress(h, blk, t + len, 1);
+
+	for (i = 0; i < SHRINK_DIGEST_LEN / 8; i++)
+		s_put64le(out + i * 8, h[i]);
+}
+
+/*
+ * Filters.  These are reversible transforms that make fixed width data and
+ * x86 code easier to compress.  All of them preserve the length.
+ */
+static int
+s_scratch(struct shrink_ctx *ctx, size_t len)
+{
+	uint8_t			*p;
+
+	if (ctx->s_scratchsz >= len)
+		return (SHRINK_OK);
+	if ((p = realloc(ctx->s_scratch, len)) == NULL)
+		return (SHRINK_LIBC);
+	ctx->s_scratch = p;
+	ctx->s_scratchsz = len;
+
+	return (SHRINK_OK);
+}
+
+#if defined(SHRINK_X86_64)
+/*
+ * Byte shuffle is a transpose of an elements by stride byte matrix.  For
+ * power of two strides a block of 16 elements is transposed in registers:
+ * one round of unpacks over vector pairs (i, i + stride / 2) rotates the
+ * byte index within the block left by one bit.  Shuffling needs 4 rounds,
+ * unshuffling log2(stride).
+ */
+#define SHRINK_SIMD_STRIDE(s)	((s) == 2 || (s) == 4 || (s) == 8 || (s) == 16)
+
+static int
+s_log2(int v)
+{
+	int			r = 0;
+
+	while (v >>= 1)
+		r++;
+	return (r);
+}
+
+static void
+s_riffle_sse2(__m128i *v, int stride, int rounds)
+{
+	__m128i			w[16];
+	int			h = stride / 2, j, r;
+
+	for (r = 0; r < rounds; r++) {
+		for (j = 0; j < h; j++) {
+			w[2 * j] = _mm_unpacklo_epi8(v[j], v[j + h]);
+			w[2 * j + 1] = _mm_unpackhi_epi8(v[j], v[j + h]);
+		}
+		memcpy(v, w, stride * sizeof(*v));
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+s_riffle_avx2(__m256i *v, int stride, int rounds)
+{
+	__m256i			w[16];
+	int			h = stride / 2, j, r;
+
+	for (r = 0; r < rounds; r++) {
+		for (j = 0; j < h; j++) {
+			w[2 * j] = _mm256_unpacklo_epi8(v[j], v[j + h]);
+			w[2 * j + 1] = _mm256_unpackhi_epi8(v[j], v[j + h]);
+		}
+		memcpy(v, w, stride * sizeof(*v));
+	}
+}
+
+static size_t
+s_shuffle_sse2(uint8_t *dst, const uint8_t *src, size_t n, int stride,
+    size_t e)
+{
+	__m128i			v[16];
+	int			j;
+
+	for (; e + 16 <= n; e += 16) {
+		for (j = 0; j < stride; j++)
+			v[j] = _mm_loadu_si128((const __m128i *)
+			    (src + e * stride + 16 * j));
+		s_riffle_sse2(v, stride, 4);
+		for (j = 0; j < stride; j++)
+			_mm_storeu_si128((__m128i *)(dst + j * n + e), v[j]);
+	}
+
+	return (e);
+}
+
+static size_t
+s_unshuffle_sse2(uint8_t *dst, const uint8_t *src, size_t n, int stride,
+    size_t e)
+{
+	__m128i			v[16];
+	int			j;
+
+	for (; e + 16 <= n; e += 16) {
+		for (j = 0; j < stride; j++)
+			v[j] = _mm_loadu_si128((const __m128i *)
+			    (src + j * n + e));
+		s_riffle_sse2(v, stride, s_log2(stride));
+		for (j = 0; j < stride; j++)
+			_mm_storeu_si128((__m128i *)(dst + e * stride + 16 * j),
+			    v[j]);
+	}
+
+	return (e);
+}
+
+/* two 16 element blocks side by side, one per 128 bit lane */
+__attribute__((target("avx2")))
+static size_t
+s_shuffle_avx2(uint8_t *dst, const uint8_t *src, size_t n, int stride,
+    size_t e)
+{
+	__m256i			v[16];
+	int			j;
+
+	for (; e + 32 <= n; e += 32) {
+		for (j = 0; j < stride; j++)
+			v[j] = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			    _mm_loadu_si128((const __m128i *)
+			    (src + e * stride + 16 * j))),
+			    _mm_loadu_si128((const __m128i *)
+			    (src + (e + 16) * stride + 16 * j)), 1);
+		s_riffle_avx2(v, stride, 4);
+		for (j = 0; j < stride; j++)
+			_mm256_storeu_si256((__m256i *)(dst + j * n + e), v[j]);
+	}
+
+	return (e);
+}
+
+__attribute__((target("avx2")))
+static size_t
+s_unshuffle_avx2(uint8_t *dst, const uint8_t *src, size_t n, int stride,
+    size_t e)
+{
+	__m256i			v[16];
+	int			j;
+
+	for (; e + 32 <= n; e += 32) {
+		for (j = 0; j < stride; j++)
+			v[j] = _mm256_loadu_si256((const __m256i *)
+			    (src + j * n + e));
+		s_riffle_avx2(v, stride, s_log2(stride));
+		for (j = 0; j < stride; j++) {
+			_mm_storeu_si128((__m128i *)(dst + e * stride + 16 * j),
+			    _mm256_castsi256_si128(v[j]));
+			_mm_storeu_si128((__m128i *)
+			    (dst + (e + 16) * stride + 16 * j),
+			    _mm256_extracti128_si256(v[j], 1));
+		}
+	}
+
+	return (e);
+}
+
+static size_t
+s_delta_encode_sse2(uint8_t *dst, const uint8_t *src, size_t len, int stride,
+    size_t i)
+{
+	for (; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi8(
+		    _mm_loadu_si128((const __m128i *)(src + i)),
+		    _mm_loadu_si128((const __m128i *)(src + i - stride))));
+
+	return (i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+s_delta_encode_avx2(uint8_t *dst, const uint8_t *src, size_t len, int stride,
+    size_t i)
+{
+	for (; i + 32 <= len; i += 32)
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi8(
+		    _mm256_loadu_si256((const __m256i *)(src + i)),
+		    _mm256_loadu_si256((const __m256i *)(src + i - stride))));
+
+	return (i);
+}
+
+/*
+ * Decoding is a prefix sum.  Strides of 16 and up have no dependency within
+ * a vector; 1, 2, 4 and 8 are scanned in register and carry the last stride
+ * bytes into the next vector.
+ */
+static size_t
+s_delta_decode_sse2(uint8_t *buf, size_t len, int stride)
+{
+	__m128i			c, x;
+	size_t			i;
+
+	if (stride >= 16) {
+		for (i = stride; i + 16 <= len; i += 16)
+			_mm_storeu_si128((__m128i *)(buf + i), _mm_add_epi8(
+			    _mm_loadu_si128((const __m128i *)(buf + i)),
+			    _mm_loadu_si128((const __m128i *)
+			    (buf + i - stride))));
+		return (i);
+	}
+	if (stride != 1 && stride != 2 && stride != 4 && stride != 8)
+		return (0);
+
+	c = _mm_setzero_si128();
+	for (i = 0; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(buf + i));
+		switch (stride) {
+		case 1:
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+			/* FALLTHROUGH */
+		case 2:
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+			/* FALLTHROUGH */
+		case 4:
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+			/* FALLTHROUGH */
+		case 8:
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+		}
+		x = _mm_add_epi8(x, c);
+		_mm_storeu_si128((__m128i *)(buf + i), x);
+
+		switch (stride) {
+		case 1:
+			c = _mm_srli_si128(x, 15);
+			c = _mm_unpacklo_epi8(c, c);
+			c = _mm_shufflelo_epi16(c, 0);
+			c = _mm_shuffle_epi32(c, 0);
+			break;
+		case 2:
+			c = _mm_shufflelo_epi16(_mm_srli_si128(x, 14), 0);
+			c = _mm_shuffle_epi32(c, 0);
+			break;
+		case 4:
+			c = _mm_shuffle_epi32(x, 0xff);
+			break;
+		case 8:
+			c = _mm_unpackhi_epi64(x, x);
+			break;
+		}
+	}
+
+	return (i);
+}
+#endif /* SHRINK_X86_64 */
+
+static void
+s_shuffle(uint8_t *dst, const uint8_t *src, size_t len, int stride)
+{
+	size_t			n = len / stride, e = 0;
+	int			b;
+
+#if defined(SHRINK_X86_64)
+	if (SHRINK_SIMD_STRIDE(stride)) {
+		if (__builtin_cpu_supports("avx2"))
+			e = s_shuffle_avx2(dst, src, n, stride, e);
+		e = s_shuffle_sse2(dst, src, n, stride, e);
+	}
+#endif /* SHRINK_X86_64 */
+	for (; e < n; e++)
+		for (b = 0; b < stride; b++)
+			dst[b * n + e] = src[e * stride + b];
+	/* trailing partial element is left alone */
+	memcpy(dst + n * stride, src + n * stride, len - n * stride);
+}
+
+static void
+s_unshuffle(uint8_t *dst, const uint8_t *src, size_t len, int stride)
+{
+	size_t			n = len / stride, e = 0;
+	int			b;
+
+#if defined(SHRINK_X86_64)
+	if (SHRINK_SIMD_STRIDE(stride)) {
+		if (__builtin_cpu_supports("avx2"))
+			e = s_unshuffle_avx2(dst, src, n, stride, e);
+		e = s_unshuffle_sse2(dst, src, n, stride, e);
+	}
+#endif /* SHRINK_X86_64 */
+	for (; e < n; e++)
+		for (b = 0; b < stride; b++)
+			dst[e * stride + b] = src[b * n + e];
+	memcpy(dst + n * stride, src + n * stride, len - n * stride);
+}
+
+static void
+s_delta_encode(uint8_t *dst, const uint8_t *src, size_t len, int stride)
+{
+	size_t			i;
+
+	if (len <= (size_t)stride) {
+		memcpy(dst, src, len);
+		return;
+	}
+	memcpy(dst, src, stride);
+	i = stride;
+#if defined(SHRINK_X86_64)
+	if (__builtin_cpu_supports("avx2"))
+		i = s_delta_encode_avx2(dst, src, len, stride, i);
+	i = s_delta_encode_sse2(dst, src, len, stride, i);
+#endif /* SHRINK_X86_64 */
+	for (; i < len; i++)
+		dst[i] = src[i] - src[i - stride];
+}
+
+static void
+s_delta_decode(uint8_t *buf, size_t len, int stride)
+{
+	size_t			i = 0;
+
+#if defined(SHRINK_X86_64)
+	i = s_delta_decode_sse2(buf, len, stride);
+#endif /* SHRINK_X86_64 */
+	if (i < (size_t)stride)
+		i = stride;
+	for (; i < len; i++)
+		buf[i] += buf[i - stride];
+}
+
+/*
+ * x86 BCJ: turn the rel32 of E8 (call) and E9 (jmp) into absolute addresses
+ * so that repeated calls to the same function become identical byte strings.
+ * Only targets inside a 16MB window are converted; the mapping is a
+ * bijection on [-offset, 16MB) so decoding needs no side information.
+ * Both directions skip the 4 operand bytes after a match which keeps the
+ * opcode positions the same for encoder and decoder.
+ */
+#define SHRINK_BCJ_WINDOW	(1 << 24)
+
+static void
+s_bcj_x86(uint8_t *buf, size_t len, int encode)
+{
+	int64_t			a, off;
+	size_t			i;
+	int			k;
+
+	for (i = 0; i + 5 <= len;) {
+		if ((buf[i] & 0xfe) != 0xe8) {
+			i++;
+			continue;
+		}
+		off = i + 5;
+		a = (int32_t)s_get32le(buf + i + 1);
+		if (encode) {
+			if (a >= SHRINK_BCJ_WINDOW - off && a < SHRINK_BCJ_WINDOW)
+				a -= SHRINK_BCJ_WINDOW;
+			else if (a >= -off && a < SHRINK_BCJ_WINDOW - off)
+				a += off;
+		} else {
+			if (a >= -off && a < 0)
+				a += SHRINK_BCJ_WINDOW;
+			else if (a >= 0 && a < SHRINK_BCJ_WINDOW)
+				a -= off;
+		}
+		for (k = 0; k < 4; k++)
+			buf[i + 1 + k] = (uint32_t)a >> (k * 8);
+		i += 5;
+	}
+}
+
+static void
+s_filter(uint8_t *dst, const uint8_t *src, size_t len, int filter, int stride)
+{
+	switch (filter) {
+	case SHRINK_FILTER_SHUFFLE:
+		s_shuffle(dst, src, len, stride);
+		break;
+	case SHRINK_FILTER_DELTA:
+		s_delta_encode(dst, src, len, stride);
+		break;
+	case SHRINK_FILTER_BCJ_X86:
+		memcpy(dst, src, len);
+		s_bcj_x86(dst, len, 1);
+		break;
+	}
+}
+
+/* reverse a filter in place */
+static int
+s_unfilter(struct shrink_ctx *ctx, uint8_t *buf, size_t len, int filter,
+    int stride)
+{
+	switch (filter) {
+	case SHRINK_FILTER_SHUFFLE:
+		if (s_scratch(ctx, len))
+			return (SHRINK_LIBC);
+		s_unshuffle(ctx->s_scratch, buf, len, stride);
+		memcpy(buf, ctx->s_scratch, len);
+		break;
+	case SHRINK_FILTER_DELTA:
+		s_delta_decode(buf, len, stride);
+		break;
+	case SHRINK_FILTER_BCJ_X86:
+		s_bcj_x86(buf, len, 0);
+		break;
+	}
+
+	return (SHRINK_OK);
+}
+
+/* block framing */
+static int
+s_framed(struct shrink_ctx *ctx)
+{
+	return (ctx->s_csum != SHRINK_CSUM_NONE ||
+	    ctx->s_filter != SHRINK_FILTER_NONE || ctx->s_histmax != 0);
+}
+
+/* slide the history window over a block as the backend saw it */
+static void
+s_hist_update(struct shrink_ctx *ctx, const uint8_t *p, size_t len)
+{
+	size_t			keep;
+
+	if (ctx->s_histmax == 0)
+		return;
+	if (len >= ctx->s_histmax) {
+		memcpy(ctx->s_hist, p + len - ctx->s_histmax, ctx->s_histmax);
+		ctx->s_histlen = ctx->s_histmax;
+		return;
+	}
+
+	keep = ctx->s_histmax - len;
+	if (keep > ctx->s_histlen)
+		keep = ctx->s_histlen;
+	memmove(ctx->s_hist, ctx->s_hist + ctx->s_histlen - keep, keep);
+	memcpy(ctx->s_hist + keep, p, len);
+	ctx->s_histlen = keep + len;
+}
+
+/* point the backend at the history a block was compressed against */
+static int
+s_hist_use(struct shrink_ctx *ctx, struct shrink_hdr *hdr)
+{
+	if (hdr->sh_hist == 0) {
+		/* keyframe, history before it does not carry over */
+		ctx->s_histlen = 0;
+		return (SHRINK_OK);
+	}
+	/* out of sync, e.g. decoding did not start at a keyframe */
+	if (hdr->sh_hist > ctx->s_histlen)
+		return (SHRINK_INTEGRITY);
+	ctx->s_dict = ctx->s_hist + ctx->s_histlen - hdr->sh_hist;
+	ctx->s_dictlen = hdr->sh_hist;
+
+	return (SHRINK_OK);
+}
+
+static void
+s_hdr_put(struct shrink_hdr *hdr, uint8_t *p)
+{
+	bzero(p, SHRINK_HDR_SZ);
+	p[0] = SHRINK_HDR_MAGIC;
+	p[1] = SHRINK_HDR_VERSION;
+	p[2] = hdr->sh_csum;
+	p[3] = hdr->sh_filter;
+	p[4] = hdr->sh_stride;
+	p[5] = hdr->sh_hist & 0xff;
+	p[6] = (hdr->sh_hist >> 8) & 0xff;
+	p[7] = (hdr->sh_hist >> 16) & 0xff;
+	s_put64le(p + 8, hdr->sh_sum);
+}
+
+static int
+s_hdr_get(struct shrink_hdr *hdr, const uint8_t *p, size_t len)
+{
+	if (len < SHRINK_HDR_SZ)
+		return (SHRINK_INTEGRITY);
+	if (p[0] != SHRINK_HDR_MAGIC || p[1] != SHRINK_HDR_VERSION)
+		return (SHRINK_INTEGRITY);
+	if (p[2] > SHRINK_CSUM_XXH64)
+		return (SHRINK_INTEGRITY);
+	if (p[3] > SHRINK_FILTER_BCJ_X86)
+		return (SHRINK_INTEGRITY);
+	if ((p[3] == SHRINK_FILTER_SHUFFLE || p[3] == SHRINK_FILTER_DELTA) &&
+	    p[4] == 0)
+		return (SHRINK_INTEGRITY);
+
+	hdr->sh_csum = p[2];
+	hdr->sh_filter = p[3];
+	hdr->sh_stride = p[4];
+	hdr->sh_hist = p[5] | (p[6] << 8) | (p[7] << 16);
+	hdr->sh_sum = s_get64le(p + 8);
+
+	return (SHRINK_OK);
+}
+
+static int
+s_compress_framed(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
+    size_t len, size_t *comp_sz)
+{
+	struct shrink_hdr	hdr;
+	size_t			csz;
+	int			ret;
+
+	if (*comp_sz < SHRINK_HDR_SZ)
+		return (SHRINK_INTEGRITY);
+
+	hdr.sh_csum = ctx->s_csum;
+	hdr.sh_sum = s_checksum(ctx->s_csum, src, len);
+	hdr.sh_filter = ctx->s_filter;
+	hdr.sh_stride = ctx->s_stride;
+	hdr.sh_hist = 0;
+
+	if (ctx->s_histmax) {
+		if (ctx->s_keyint && ctx->s_nblocks % ctx->s_keyint == 0)
+			ctx->s_histlen = 0;
+		hdr.sh_hist = ctx->s_histlen;
+		ctx->s_dict = ctx->s_hist;
+		ctx->s_dictlen = ctx->s_histlen;
+	}
+
+	if (ctx->s_filter != SHRINK_FILTER_NONE) {
+		if (s_scratch(ctx, len))
+			return (SHRINK_LIBC);
+		s_filter(ctx->s_scratch, src, len, ctx->s_filter,
+		    ctx->s_stride);
+		src = ctx->s_scratch;
+	}
+
+	csz = *comp_sz - SHRINK_HDR_SZ;
+	ret = ctx->s_compress(ctx, src, dst + SHRINK_HDR_SZ, len, &csz);
+	ctx->s_dictlen = 0;
+	if (ret)
+		return (ret);
+	s_hist_update(ctx, src, len);
+	ctx->s_nblocks++;
+	s_hdr_put(&hdr, dst);
+	*comp_sz = csz + SHRINK_HDR_SZ;
+
+	return (SHRINK_OK);
+}
+
+/* undo whatever the header says was done to the block */
+static int
+s_frame_finish(struct shrink_ctx *ctx, struct shrink_hdr *hdr, uint8_t *dst,
+    size_t len)
+{
+	if (s_unfilter(ctx, dst, len, hdr->sh_filter, hdr->sh_stride))
+		return (SHRINK_LIBC);
+	if (hdr->sh_csum != SHRINK_CSUM_NONE &&
+	    s_checksum(hdr->sh_csum, dst, len) != hdr->sh_sum)
+		return (SHRINK_INTEGRITY);
+
+	return (SHRINK_OK);
+}
+
+static int
+s_decompress_framed(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
+    size_t len, size_t *uncomp_sz)
+{
+	struct shrink_hdr	hdr;
+	int			ret;
+
+	/* read the header first, in-place decompression overwrites it */
+	if ((ret = s_hdr_get(&hdr, src, len)))
+		return (ret);
+	if ((ret = s_hist_use(ctx, &hdr)))
+		return (ret);
+
+	/* unshuffle straight out of scratch when the buffers are separate */
+	if (hdr.sh_filter == SHRINK_FILTER_SHUFFLE &&
+	    (src + len <= dst || src >= dst + *uncomp_sz)) {
+		if (s_scratch(ctx, *uncomp_sz))
+			return (SHRINK_LIBC);
+		ret = ctx->s_decompress(ctx, src + SHRINK_HDR_SZ,
+		    ctx->s_scratch, len - SHRINK_HDR_SZ, uncomp_sz);
+		ctx->s_dictlen = 0;
+		if (ret)
+			return (ret);
+		s_hist_update(ctx, ctx->s_scratch, *uncomp_sz);
+		s_unshuffle(dst, ctx->s_scratch, *uncomp_sz, hdr.sh_stride);
+		hdr.sh_filter = SHRINK_FILTER_NONE;
+	} else {
+		ret = ctx->s_decompress(ctx, src + SHRINK_HDR_SZ, dst,
+		    len - SHRINK_HDR_SZ, uncomp_sz);
+		ctx->s_dictlen = 0;
+		if (ret)
+			return (ret);
+		s_hist_update(ctx, dst, *uncomp_sz);
+	}
+
+	return (s_frame_finish(ctx, &hdr, dst, *uncomp_sz));
+}
+
+static int
+s_decompress_grow_framed(struct shrink_ctx *ctx, uint8_t *src, size_t len,
+    uint8_t **dst, size_t *dstsz, size_t *uncomp_sz)
+{
+	struct shrink_hdr	hdr;
+	int			ret;
+
+	if ((ret = s_hdr_get(&hdr, src, len)))
+		return (ret);
+	if ((ret = s_hist_use(ctx, &hdr)))
+		return (ret);
+	ret = ctx->s_decompress_grow(ctx, src + SHRINK_HDR_SZ,
+	    len - SHRINK_HDR_SZ, dst, dstsz, uncomp_sz);
+	ctx->s_dictlen = 0;
+	if (ret)
+		return (ret);
+	s_hist_update(ctx, *dst, *uncomp_sz);
+
+	return (s_frame_finish(ctx, &hdr, *dst, *uncomp_sz));
+}
+
+struct shrink_ctx *
+shrink_init(int algorithm, int level)
+{
+	struct shrink_ctx	*ctx;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return (ctx);
+
+	switch (algorithm) {
+	case SHRINK_ALG_NULL:
+		if (level != SHRINK_L_NONE)
+			goto fail;
+
+		ctx->s_algorithm = "null";
+		ctx->s_compress = s_compress_null;
+		ctx->s_decompress = s_decompress_null;
+		ctx->s_decompress_grow = s_decompress_grow_null;
+		ctx->s_compress_bounds = s_compress_bounds_null;
+		ctx->s_inplace_margin = s_inplace_margin_null;
+		ctx->s_memusage = s_memusage_null;
+		ctx->s_memfit = s_memfit_null;
+		ctx->s_level = level;
+		break;
+#if defined(SUPPORT_LZO2)
+	case SHRINK_ALG_LZO:
+		if (lzo_init() != LZO_E_OK)
+			goto fail;
+		switch (level) {
+		case SHRINK_L_MIN:
+			ctx->s_lzo1x_compress = lzo1x_1_compress;
+			ctx->s_lzo1x_heapsz = LZO1X_1_MEM_COMPRESS;
+			ctx->s_algorithm = "lzo1x_1";
+			break;
+		case SHRINK_L_MID:
+			ctx->s_lzo1x_compress = lzo1x_1_15_compress;
+			ctx->s_lzo1x_heapsz = LZO1X_1_15_MEM_COMPRESS;
+			ctx->s_algorithm = "lzo1x_1_15";
+			break;
+		case SHRINK_L_MAX:
+			ctx->s_lzo1x_compress = lzo1x_999_compress;
+			ctx->s_lzo1x_heapsz = LZO1X_999_MEM_COMPRESS;
+			ctx->s_algorithm = "lzo1x_999";
+			break;
+		case SHRINK_L_NONE:
+		default:
+			goto fail;
+		}
+		ctx->s_compress = s_compress_lzo;
+		ctx->s_decompress = s_decompress_lzo;
+		ctx->s_decompress_grow = s_decompress_grow_lzo;
+		ctx->s_level = level;
 		ctx->s_compress_bounds = s_compress_bounds_lzo;
+		ctx->s_inplace_margin = s_inplace_margin_lzo;
+		ctx->s_memusage = s_memusage_lzo;
+		ctx->s_memfit = s_memfit_lzo;
 		break;
 #endif /* SUPPORT_LZO2 */
 #if defined(SUPPORT_LZW)
@@ -334,103 +1804,216 @@ shrink_init(int algorithm, int level)
 			goto fail;
 		}
 		ctx->s_compress = s_compress_lzw;
+		ctx->s_chain = 1;
 		ctx->s_decompress = s_decompress_lzw;
+		ctx->s_decompress_grow = s_decompress_grow_lzw;
 		ctx->s_compress_bounds = s_compress_bounds_lzw;
+		ctx->s_inplace_margin = s_inplace_margin_lzw;
+		ctx->s_memusage = s_memusage_lzw;
+		ctx->s_memfit = s_memfit_lzw;
+		ctx->s_wbits = LZW_WBITS;
+		ctx->s_memlevel = LZW_MEMLEVEL;
 		break;
 #endif /* SUPPORT_LZW */
 #if defined(SUPPORT_LZMA)
 	case SHRINK_ALG_LZMA:
 		switch (level) {
+		/*
+		 * the names are historical, streams have always been written
+		 * with presets 1 to 3 and memory budgets are sized for those
+		 */
 		case SHRINK_L_MIN:
 			ctx->s_algorithm = "lzma_0";
-			ctx->s_level = 0;
+			ctx->s_level = 1;
 			break;
 		case SHRINK_L_MID:
 			ctx->s_algorithm = "lzma_6";
-			ctx->s_level = 5;
+			ctx->s_level = 2;
 			break;
 		case SHRINK_L_MAX:
 			ctx->s_algorithm = "lzma_9";
-			ctx->s_level = 9;
+			ctx->s_level = 3;
 			break;
 		case SHRINK_L_NONE:
 		default:
 			goto fail;
 		}
 		ctx->s_compress = s_compress_lzma;
+		ctx->s_chain = 1;
 		ctx->s_decompress = s_decompress_lzma;
+		ctx->s_decompress_grow = s_decompress_grow_lzma;
 		ctx->s_compress_bounds = s_compress_bounds_lzma;
-		ctx->s_level = level;
+		ctx->s_inplace_margin = s_inplace_margin_lzma;
+		ctx->s_memusage = s_memusage_lzma;
+		ctx->s_memfit = s_memfit_lzma;
 		break;
 #endif /* SUPPORT_LZMA */
 	default:
 		goto fail;
 	}
 
-	return (ctx);
-fail:
-	free(ctx);
-	return (NULL);
-}
+	return (ctx);
+fail:
+	free(ctx);
+	return (NULL);
+}
+
+void
+shrink_cleanup(struct shrink_ctx *ctx)
+{
+	/* XXX cleanup library state if any? */
+	if (ctx != NULL) {
+		free(ctx->s_scratch);
+		free(ctx->s_hist);
+		free(ctx);
+	}
+}
+
+int
+shrink_compress(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst, size_t len,
+    size_t *comp_sz, struct timeval *elapsed)
+{
+	struct timeval		end, start;
+	int			ret;
+
+	/* sanity */
+	if (ctx == NULL)
+		return (SHRINK_INVALID);
+	if (comp_sz == NULL)
+		return (SHRINK_INTEGRITY);
+	/* XXX some checks were compress_bounds, some were comp_sz < len */
+	if (shrink_compress_bounds(ctx, *comp_sz) < len)
+
+#ifdef HMMMMM
+	if (*comp_sz < len)
+#endif
+		return (SHRINK_INTEGRITY);
+
+	if (elapsed && gettimeofday(&start, NULL) == -1)
+		return (SHRINK_LIBC);
+
+	if (s_framed(ctx))
+		ret = s_compress_framed(ctx, src, dst, len, comp_sz);
+	else
+		ret = ctx->s_compress(ctx, src, dst, len, comp_sz);
+
+	if (elapsed) {
+		if (gettimeofday(&end, NULL) == -1)
+			return (SHRINK_LIBC);
+		timersub(&end, &start, elapsed);
+	}
+
+	return (ret);
+}
+int
+shrink_decompress(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
+    size_t len, size_t *uncomp_sz, struct timeval *elapsed)
+{
+	struct timeval		end, start;
+	int			ret;
+
+	if (uncomp_sz == NULL)
+		return (SHRINK_INTEGRITY);
+	/* allow for incompressible margin */
+	if (shrink_compress_bounds(ctx, *uncomp_sz) < len)
+		return (SHRINK_INTEGRITY);
+
+	if (elapsed && gettimeofday(&start, NULL) == -1)
+		return (SHRINK_LIBC);
 
-void
-shrink_cleanup(struct shrink_ctx *ctx)
-{
-	/* XXX cleanup library state if any? */
-	if (ctx != NULL)
-		free(ctx);
+	if (s_framed(ctx))
+		ret = s_decompress_framed(ctx, src, dst, len, uncomp_sz);
+	else
+		ret = ctx->s_decompress(ctx, src, dst, len, uncomp_sz);
+
+	if (elapsed) {
+		if (gettimeofday(&end, NULL) == -1)
+			return (SHRINK_LIBC);
+		timersub(&end, &start, elapsed);
+	}
+
+	return (ret);
 }
 
+/*
+ * Decompress into a buffer that is allocated and grown as needed.  On entry
+ * *uncomp_sz is a size hint which may be 0.  On success *dst must be
+ * released with free(3).
+ */
 int
-shrink_compress(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst, size_t len,
-    size_t *comp_sz, struct timeval *elapsed)
+shrink_decompress_alloc(struct shrink_ctx *ctx, uint8_t *src, size_t len,
+    uint8_t **dst, size_t *uncomp_sz, struct timeval *elapsed)
 {
 	struct timeval		end, start;
+	uint8_t			*buf;
+	size_t			bufsz;
 	int			ret;
 
-	/* sanity */
 	if (ctx == NULL)
 		return (SHRINK_INVALID);
-	if (comp_sz == NULL)
-		return (SHRINK_INTEGRITY);
-	/* XXX some checks were compress_bounds, some were comp_sz < len */
-	if (shrink_compress_bounds(ctx, *comp_sz) < len)
-
-#ifdef HMMMMM
-	if (*comp_sz < len)
-#endif
+	if (dst == NULL || uncomp_sz == NULL)
 		return (SHRINK_INTEGRITY);
 
 	if (elapsed && gettimeofday(&start, NULL) == -1)
 		return (SHRINK_LIBC);
 
-	ret = ctx->s_compress(ctx, src, dst, len, comp_sz);
+	/* guess 4:1 when the caller has no idea */
+	bufsz = *uncomp_sz;
+	if (bufsz == 0)
+		bufsz = len * 4;
+	if (bufsz < 4096)
+		bufsz = 4096;
+	if ((buf = malloc(bufsz)) == NULL)
+		return (SHRINK_LIBC);
 
-	if (elapsed) {
+	if (s_framed(ctx))
+		ret = s_decompress_grow_framed(ctx, src, len, &buf, &bufsz,
+		    uncomp_sz);
+	else
+		ret = ctx->s_decompress_grow(ctx, src, len, &buf, &bufsz,
+		    uncomp_sz);
+	if (ret == SHRINK_OK && elapsed) {
 		if (gettimeofday(&end, NULL) == -1)
-			return (SHRINK_LIBC);
+			ret = SHRINK_LIBC;
 		timersub(&end, &start, elapsed);
 	}
+	if (ret != SHRINK_OK) {
+		free(buf);
+		return (ret);
+	}
+	*dst = buf;
 
-	return (ret);
+	return (SHRINK_OK);
 }
+
+/*
+ * Decompress in place.  The len bytes of compressed data sit at the very end
+ * of buf and are decoded forward over themselves starting at buf.  bufsz must
+ * be at least shrink_inplace_bounds of the uncompressed size.
+ */
 int
-shrink_decompress(struct shrink_ctx *ctx, uint8_t *src, uint8_t *dst,
+shrink_decompress_inplace(struct shrink_ctx *ctx, uint8_t *buf, size_t bufsz,
     size_t len, size_t *uncomp_sz, struct timeval *elapsed)
 {
 	struct timeval		end, start;
 	int			ret;
 
+	if (ctx == NULL)
+		return (SHRINK_INVALID);
 	if (uncomp_sz == NULL)
 		return (SHRINK_INTEGRITY);
-	/* allow for incompressible margin */
-	if (shrink_compress_bounds(ctx, *uncomp_sz) < len)
+	if (len > bufsz || shrink_inplace_bounds(ctx, *uncomp_sz) > bufsz)
 		return (SHRINK_INTEGRITY);
 
 	if (elapsed && gettimeofday(&start, NULL) == -1)
 		return (SHRINK_LIBC);
 
-	ret = ctx->s_decompress(ctx, src, dst, len, uncomp_sz);
+	if (s_framed(ctx))
+		ret = s_decompress_framed(ctx, buf + bufsz - len, buf, len,
+		    uncomp_sz);
+	else
+		ret = ctx->s_decompress(ctx, buf + bufsz - len, buf, len,
+		    uncomp_sz);
 
 	if (elapsed) {
 		if (gettimeofday(&end, NULL) == -1)
@@ -452,8 +2035,26 @@ shrink_malloc(struct shrink_ctx *ctx, size_t *sz)
 	if (sz == NULL)
 		return (NULL);
 	real_sz = shrink_compress_bounds(ctx, *sz);
-	p = malloc(real_sz);
-	if (p == NULL)
+	/* cache line aligned so it can still be released with free(3) */
+	if (posix_memalign(&p, SHRINK_ALIGN_CACHE, real_sz))
+		return (NULL);
+
+	*sz = real_sz;
+	return (p);
+}
+
+void *
+shrink_malloc_inplace(struct shrink_ctx *ctx, size_t *sz)
+{
+	void		*p;
+	size_t		 real_sz;
+
+	if (ctx == NULL)
+		return (NULL);
+	if (sz == NULL)
+		return (NULL);
+	real_sz = shrink_inplace_bounds(ctx, *sz);
+	if (posix_memalign(&p, SHRINK_ALIGN_CACHE, real_sz))
 		return (NULL);
 
 	*sz = real_sz;
@@ -463,9 +2064,19 @@ shrink_malloc(struct shrink_ctx *ctx, size_t *sz)
 size_t
 shrink_compress_bounds(struct shrink_ctx *ctx, size_t sz)
 {
+	if (s_framed(ctx))
+		return (ctx->s_compress_bounds(ctx, sz) + SHRINK_HDR_SZ);
 	return (ctx->s_compress_bounds(ctx, sz));
 }
 
+size_t
+shrink_inplace_bounds(struct shrink_ctx *ctx, size_t sz)
+{
+	if (s_framed(ctx))
+		return (sz + ctx->s_inplace_margin(ctx, sz) + SHRINK_HDR_SZ);
+	return (sz + ctx->s_inplace_margin(ctx, sz));
+}
+
 const char *
 shrink_get_algorithm(struct shrink_ctx *ctx)
 {
@@ -474,6 +2085,490 @@ shrink_get_algorithm(struct shrink_ctx *ctx)
 	return (ctx->s_algorithm);
 }
 
+/* buffer pool */
+static size_t
+s_pool_size(int c)
+{
+	int			shift;
+
+	if (c < SHRINK_POOL_POW2)
+		return ((size_t)1 << (c + SHRINK_POOL_MINSHIFT));
+	c -= SHRINK_POOL_POW2;
+	if (c < SHRINK_POOL_LINEAR)
+		return ((size_t)(c + 2) * SHRINK_HUGE_SZ);
+	c -= SHRINK_POOL_LINEAR;
+	shift = SHRINK_POOL_STEPSHIFT + c / SHRINK_POOL_STEPS;
+	return (((size_t)1 << shift) / SHRINK_POOL_STEPS *
+	    (SHRINK_POOL_STEPS + c % SHRINK_POOL_STEPS + 1));
+}
+
+static int
+s_pool_class(size_t sz)
+{
+	int			c;
+
+	for (c = 0; c < SHRINK_POOL_CLASSES; c++)
+		if (sz <= s_pool_size(c))
+			return (c);
+	return (-1);
+}
+
+static int
+s_pool_mapped(struct shrink_pool *pool, size_t csz)
+{
+	return ((pool->sp_flags & SHRINK_POOL_HUGE) && csz >= SHRINK_HUGE_SZ &&
+	    pool->sp_align <= pool->sp_pagesz);
+}
+
+static void *
+s_pool_alloc(struct shrink_pool *pool, size_t csz)
+{
+	void			*p;
+
+	if (s_pool_mapped(pool, csz)) {
+#if defined(MAP_HUGETLB)
+		/* only succeeds when the admin reserved huge pages */
+		p = mmap(NULL, csz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			return (p);
+#endif /* MAP_HUGETLB */
+		p = mmap(NULL, csz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (p == MAP_FAILED)
+			return (NULL);
+#if defined(MADV_HUGEPAGE)
+		/* transparent huge pages; failure is not fatal */
+		madvise(p, csz, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+		return (p);
+	}
+
+	if (posix_memalign(&p, pool->sp_align, csz))
+		return (NULL);
+	return (p);
+}
+
+static void
+s_pool_release(struct shrink_pool *pool, void *p, size_t csz)
+{
+	if (s_pool_mapped(pool, csz))
+		munmap(p, csz);
+	else
+		free(p);
+}
+
+struct shrink_pool *
+shrink_pool_init(size_t align, int flags)
+{
+	struct shrink_pool	*pool;
+	long			pagesz;
+
+	if ((pagesz = sysconf(_SC_PAGESIZE)) == -1)
+		return (NULL);
+	if (align == SHRINK_ALIGN_PAGE)
+		align = pagesz;
+	/* posix_memalign(3) rules */
+	if (align < sizeof(void *) || (align & (align - 1)))
+		return (NULL);
+	if (flags & ~SHRINK_POOL_HUGE)
+		return (NULL);
+
+	if ((pool = calloc(1, sizeof(*pool))) == NULL)
+		return (NULL);
+	pool->sp_align = align;
+	pool->sp_pagesz = pagesz;
+	pool->sp_flags = flags;
+
+	return (pool);
+}
+
+void
+shrink_pool_cleanup(struct shrink_pool *pool)
+{
+	int			c;
+
+	if (pool == NULL)
+		return;
+
+	for (c = 0; c < SHRINK_POOL_CLASSES; c++)
+		while (pool->sp_class[c].sc_count > 0)
+			s_pool_release(pool, pool->sp_class[c].sc_free[
+			    --pool->sp_class[c].sc_count], s_pool_size(c));
+	free(pool);
+}
+
+void *
+shrink_pool_malloc(struct shrink_pool *pool, struct shrink_ctx *ctx,
+    size_t *sz)
+{
+	void			*p;
+	size_t			real_sz;
+	int			c;
+
+	if (pool == NULL || sz == NULL)
+		return (NULL);
+
+	real_sz = ctx ? shrink_compress_bounds(ctx, *sz) : *sz;
+	if ((c = s_pool_class(real_sz)) == -1)
+		return (NULL);
+
+	if (pool->sp_class[c].sc_count > 0)
+		p = pool->sp_class[c].sc_free[--pool->sp_class[c].sc_count];
+	else if ((p = s_pool_alloc(pool, s_pool_size(c))) == NULL)
+		return (NULL);
+
+	*sz = real_sz;
+	return (p);
+}
+
+void
+shrink_pool_free(struct shrink_pool *pool, void *p, size_t sz)
+{
+	int			c;
+
+	if (pool == NULL || p == NULL)
+		return;
+	if ((c = s_pool_class(sz)) == -1)
+		return;
+
+	if (pool->sp_class[c].sc_count < SHRINK_POOL_DEPTH)
+		pool->sp_class[c].sc_free[pool->sp_class[c].sc_count++] = p;
+	else
+		s_pool_release(pool, p, s_pool_size(c));
+}
+
+/*
+ * Content defined chunking.  A gear rolling hash (FastCDC) cuts the input
+ * where the hash matches a mask so boundaries move with the content and an
+ * insert only disturbs the chunks around it.  A stricter mask below the
+ * average size and a looser one above it keep chunk sizes close to the
+ * average.  Chunks are identified by their BLAKE2b digest; only chunks not
+ * seen before are compressed.
+ */
+#define SHRINK_CDC_MINSZ	(64)
+#define SHRINK_CDC_MAXSZ	(1024 * 1024 * 1024)
+#define SHRINK_CDC_TABSZ	(1024)	/* initial index size */
+#define SHRINK_CDC_SEED		(0x5348524b43444321ULL)
+
+struct shrink_cdc_ent {
+	uint8_t		se_digest[SHRINK_DIGEST_LEN];
+	uint64_t	se_ref;		/* chunk id + 1, 0 when unused */
+};
+
+struct shrink_cdc {
+	struct shrink_ctx	*sd_ctx;
+	size_t			sd_min;
+	size_t			sd_avg;
+	size_t			sd_max;
+	uint64_t		sd_mask_s;	/* below sd_avg */
+	uint64_t		sd_mask_l;	/* above sd_avg */
+	uint64_t		sd_gear[256];
+	struct shrink_cdc_ent	*sd_tab;
+	size_t			sd_tabsz;	/* power of two */
+	uint64_t		sd_nchunks;	/* unique chunks */
+};
+
+/* the n high bits; gear hash bits only carry history going up */
+static uint64_t
+s_cdc_mask(int n)
+{
+	return (~0ULL << (64 - n));
+}
+
+static struct shrink_cdc_ent *
+s_cdc_find(struct shrink_cdc_ent *tab, size_t tabsz, const uint8_t *digest)
+{
+	size_t			i;
+
+	/* the digest is already uniformly distributed */
+	for (i = s_get64le(digest) & (tabsz - 1);; i = (i + 1) & (tabsz - 1))
+		if (tab[i].se_ref == 0 || !memcmp(tab[i].se_digest, digest,
+		    SHRINK_DIGEST_LEN))
+			return (&tab[i]);
+}
+
+static int
+s_cdc_grow(struct shrink_cdc *cdc)
+{
+	struct shrink_cdc_ent	*tab, *e;
+	size_t			i, tabsz = cdc->sd_tabsz * 2;
+
+	if ((tab = calloc(tabsz, sizeof(*tab))) == NULL)
+		return (SHRINK_LIBC);
+	for (i = 0; i < cdc->sd_tabsz; i++) {
+		if (cdc->sd_tab[i].se_ref == 0)
+			continue;
+		e = s_cdc_find(tab, tabsz, cdc->sd_tab[i].se_digest);
+		*e = cdc->sd_tab[i];
+	}
+	free(cdc->sd_tab);
+	cdc->sd_tab = tab;
+	cdc->sd_tabsz = tabsz;
+
+	return (SHRINK_OK);
+}
+
+struct shrink_cdc *
+shrink_cdc_init(struct shrink_ctx *ctx, size_t min, size_t avg, size_t max)
+{
+	struct shrink_cdc	*cdc;
+	uint64_t		x = SHRINK_CDC_SEED, z;
+	int			i, bits;
+
+	if (min < SHRINK_CDC_MINSZ || avg < min || max < avg ||
+	    max > SHRINK_CDC_MAXSZ)
+		return (NULL);
+
+	if ((cdc = calloc(1, sizeof(*cdc))) == NULL)
+		return (NULL);
+	cdc->sd_tabsz = SHRINK_CDC_TABSZ;
+	if ((cdc->sd_tab = calloc(cdc->sd_tabsz,
+	    sizeof(*cdc->sd_tab))) == NULL) {
+		free(cdc);
+		return (NULL);
+	}
+	cdc->sd_ctx = ctx;
+	cdc->sd_min = min;
+	cdc->sd_avg = avg;
+	cdc->sd_max = max;
+
+	/* normalized chunking, two bits either side of log2(avg) */
+	for (bits = 0; ((size_t)2 << bits) <= avg; bits++)
+		;
+	cdc->sd_mask_s = s_cdc_mask(bits + 2);
+	cdc->sd_mask_l = s_cdc_mask(bits > 2 ? bits - 2 : 1);
+
+	/* splitmix64; fixed so that boundaries are stable between runs */
+	for (i = 0; i < 256; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		cdc->sd_gear[i] = z ^ (z >> 31);
+	}
+
+	return (cdc);
+}
+
+void
+shrink_cdc_cleanup(struct shrink_cdc *cdc)
+{
+	if (cdc == NULL)
+		return;
+	free(cdc->sd_tab);
+	free(cdc);
+}
+
+void
+shrink_cdc_reset(struct shrink_cdc *cdc)
+{
+	if (cdc == NULL)
+		return;
+	memset(cdc->sd_tab, 0, cdc->sd_tabsz * sizeof(*cdc->sd_tab));
+	cdc->sd_nchunks = 0;
+}
+
+size_t
+shrink_cdc_cut(struct shrink_cdc *cdc, const uint8_t *src, size_t len)
+{
+	uint64_t		fp = 0;
+	size_t			i, n, normal;
+
+	if (cdc == NULL || src == NULL)
+		return (0);
+	if (len <= cdc->sd_min)
+		return (len);
+
+	n = len < cdc->sd_max ? len : cdc->sd_max;
+	normal = n < cdc->sd_avg ? n : cdc->sd_avg;
+
+	/* no point hashing bytes that can not end a chunk */
+	for (i = cdc->sd_min; i < normal; i++) {
+		fp = (fp << 1) + cdc->sd_gear[src[i]];
+		if ((fp & cdc->sd_mask_s) == 0)
+			return (i + 1);
+	}
+	for (; i < n; i++) {
+		fp = (fp << 1) + cdc->sd_gear[src[i]];
+		if ((fp & cdc->sd_mask_l) == 0)
+			return (i + 1);
+	}
+
+	return (n);
+}
+
+int
+shrink_cdc_compress(struct shrink_cdc *cdc, uint8_t *src, uint8_t *dst,
+    size_t len, size_t *comp_sz, struct shrink_chunk *chunk,
+    struct timeval *elapsed)
+{
+	struct shrink_cdc_ent	*e;
+	int			ret;
+
+	if (cdc == NULL || cdc->sd_ctx == NULL || src == NULL ||
+	    chunk == NULL || len == 0)
+		return (SHRINK_INVALID);
+	if (comp_sz == NULL)
+		return (SHRINK_INTEGRITY);
+
+	/* keep the index at most 3/4 full so probes stay short */
+	if ((cdc->sd_nchunks + 1) * 4 >= cdc->sd_tabsz * 3 &&
+	    s_cdc_grow(cdc) != SHRINK_OK)
+		return (SHRINK_LIBC);
+
+	chunk->sc_len = shrink_cdc_cut(cdc, src, len);
+	s_blake2b(chunk->sc_digest, src, chunk->sc_len);
+
+	e = s_cdc_find(cdc->sd_tab, cdc->sd_tabsz, chunk->sc_digest);
+	if (e->se_ref) {
+		chunk->sc_id = e->se_ref - 1;
+		chunk->sc_dup = 1;
+		*comp_sz = 0;
+		if (elapsed)
+			timerclear(elapsed);
+		return (SHRINK_OK);
+	}
+
+	ret = shrink_compress(cdc->sd_ctx, src, dst, chunk->sc_len, comp_sz,
+	    elapsed);
+	if (ret)
+		return (ret);
+
+	/* only remember chunks the caller has a compressed copy of */
+	memcpy(e->se_digest, chunk->sc_digest, SHRINK_DIGEST_LEN);
+	e->se_ref = ++cdc->sd_nchunks;
+	chunk->sc_id = e->se_ref - 1;
+	chunk->sc_dup = 0;
+
+	return (SHRINK_OK);
+}
+
+int
+shrink_set_checksum(struct shrink_ctx *ctx, int csum)
+{
+	if (ctx == NULL)
+		return (SHRINK_INVALID);
+	switch (csum) {
+	case SHRINK_CSUM_NONE:
+	case SHRINK_CSUM_CRC32C:
+	case SHRINK_CSUM_XXH64:
+		break;
+	default:
+		return (SHRINK_INVALID);
+	}
+	ctx->s_csum = csum;
+
+	return (SHRINK_OK);
+}
+
+int
+shrink_set_filter(struct shrink_ctx *ctx, int filter, int stride)
+{
+	if (ctx == NULL)
+		return (SHRINK_INVALID);
+	switch (filter) {
+	case SHRINK_FILTER_NONE:
+	case SHRINK_FILTER_BCJ_X86:
+		stride = 0;
+		break;
+	case SHRINK_FILTER_SHUFFLE:
+	case SHRINK_FILTER_DELTA:
+		if (stride < 1 || stride > 255)
+			return (SHRINK_INVALID);
+		break;
+	default:
+		return (SHRINK_INVALID);
+	}
+	ctx->s_filter = filter;
+	ctx->s_stride = stride;
+
+	return (SHRINK_OK);
+}
+
+int
+shrink_set_history(struct shrink_ctx *ctx, size_t histsz, int keyint)
+{
+	uint8_t			*p;
+
+	if (ctx == NULL || keyint < 0 || histsz > SHRINK_HIST_MAX)
+		return (SHRINK_INVALID);
+	if (histsz && !ctx->s_chain)
+		return (SHRINK_INVALID);
+	/* the history buffer is part of the budget */
+	if (ctx->s_memlimit && (histsz >= ctx->s_memlimit ||
+	    ctx->s_memfit(ctx, ctx->s_memlimit - histsz)))
+		return (SHRINK_MEMLIMIT);
+
+	if (histsz == 0) {
+		free(ctx->s_hist);
+		p = NULL;
+	} else if ((p = realloc(ctx->s_hist, histsz)) == NULL)
+		return (SHRINK_LIBC);
+	ctx->s_hist = p;
+	ctx->s_histmax = histsz;
+	ctx->s_keyint = keyint;
+	shrink_reset_history(ctx);
+
+	return (SHRINK_OK);
+}
+
+void
+shrink_reset_history(struct shrink_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+	ctx->s_histlen = 0;
+	ctx->s_nblocks = 0;
+}
+
+/*
+ * Memory the context allocates on its own while compressing and while
+ * decompressing.  Buffers passed in by the caller and the filter scratch
+ * buffer, which is as large as a block, are not included.
+ */
+int
+shrink_get_memusage(struct shrink_ctx *ctx, uint64_t *enc, uint64_t *dec)
+{
+	if (ctx == NULL || enc == NULL || dec == NULL)
+		return (SHRINK_INVALID);
+	ctx->s_memusage(ctx, enc, dec);
+	*enc += ctx->s_histmax;
+	*dec += ctx->s_histmax;
+
+	return (SHRINK_OK);
+}
+
+int
+shrink_memusage(int algorithm, int level, uint64_t *enc, uint64_t *dec)
+{
+	struct shrink_ctx	*ctx;
+	int			ret;
+
+	/* contexts are cheap until they are used */
+	if ((ctx = shrink_init(algorithm, level)) == NULL)
+		return (SHRINK_INVALID);
+	ret = shrink_get_memusage(ctx, enc, dec);
+	shrink_cleanup(ctx);
+
+	return (ret);
+}
+
+int
+shrink_set_memlimit(struct shrink_ctx *ctx, uint64_t limit)
+{
+	int			ret;
+
+	if (ctx == NULL)
+		return (SHRINK_INVALID);
+	if (limit && ctx->s_histmax >= limit)
+		return (SHRINK_MEMLIMIT);
+	if ((ret = ctx->s_memfit(ctx, limit ? limit - ctx->s_histmax : 0)))
+		return (ret);
+	ctx->s_memlimit = limit;
+
+	return (SHRINK_OK);
+}
+
 /* XXX old api kept for old software. not threadsafe in the slightest. */
 static struct shrink_ctx *internal_ctx = NULL;
 
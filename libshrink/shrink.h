@@ -41,6 +41,7 @@ void		 shrink_version(int *major, int *minor, int *patch);
 #define SHRINK_INVALID		(2)
 #define SHRINK_LIBC		(3)
 #define SHRINK_LIB_COMPRESS	(4)
+#define SHRINK_MEMLIMIT		(5)
 
 #define SHRINK_ALG_NULL		(0)
 #define SHRINK_ALG_LZO		(1)
@@ -52,6 +53,31 @@ void		 shrink_version(int *major, int *minor, int *patch);
 #define SHRINK_L_MID		(2)
 #define SHRINK_L_MAX		(3)
 
+#define SHRINK_CSUM_NONE	(0)
+#define SHRINK_CSUM_CRC32C	(1)
+#define SHRINK_CSUM_XXH64	(2)
+
+#define SHRINK_FILTER_NONE	(0)
+#define SHRINK_FILTER_SHUFFLE	(1)
+#define SHRINK_FILTER_DELTA	(2)
+#define SHRINK_FILTER_BCJ_X86	(3)
+
+#define SHRINK_ALIGN_PAGE	(0)
+#define SHRINK_ALIGN_CACHE	(64)
+
+#define SHRINK_POOL_HUGE	(1<<0)
+
+#define SHRINK_DIGEST_LEN	(32)
+
+#define SHRINK_HIST_MAX		(0xffffff)
+
+struct shrink_chunk {
+	size_t		sc_len;		/* uncompressed length */
+	uint64_t	sc_id;		/* unique chunk number, from 0 */
+	int		sc_dup;		/* sc_id was returned before */
+	uint8_t		sc_digest[SHRINK_DIGEST_LEN];
+};
+
 struct shrink_ctx;
 struct shrink_ctx	*shrink_init(int, int);
 void			 shrink_cleanup(struct shrink_ctx *);
@@ -59,9 +85,42 @@ int			 shrink_compress(struct shrink_ctx *, uint8_t *,
 			     uint8_t *, size_t, size_t *, struct timeval *);
 int			 shrink_decompress(struct shrink_ctx *, uint8_t *,
 			     uint8_t *, size_t, size_t *, struct timeval *);
+int			 shrink_decompress_alloc(struct shrink_ctx *, uint8_t *,
+			     size_t, uint8_t **, size_t *, struct timeval *);
+int			 shrink_decompress_inplace(struct shrink_ctx *,
+			     uint8_t *, size_t, size_t, size_t *,
+			     struct timeval *);
 void			*shrink_malloc(struct shrink_ctx *, size_t *);
+void			*shrink_malloc_inplace(struct shrink_ctx *, size_t *);
 size_t			 shrink_compress_bounds(struct shrink_ctx *, size_t);
+size_t			 shrink_inplace_bounds(struct shrink_ctx *, size_t);
 const char		*shrink_get_algorithm(struct shrink_ctx *);
+int			 shrink_set_checksum(struct shrink_ctx *, int);
+int			 shrink_set_filter(struct shrink_ctx *, int, int);
+int			 shrink_set_history(struct shrink_ctx *, size_t, int);
+void			 shrink_reset_history(struct shrink_ctx *);
+int			 shrink_memusage(int, int, uint64_t *, uint64_t *);
+int			 shrink_get_memusage(struct shrink_ctx *, uint64_t *,
+			     uint64_t *);
+int			 shrink_set_memlimit(struct shrink_ctx *, uint64_t);
+
+struct shrink_pool;
+struct shrink_pool	*shrink_pool_init(size_t, int);
+void			 shrink_pool_cleanup(struct shrink_pool *);
+void			*shrink_pool_malloc(struct shrink_pool *,
+			     struct shrink_ctx *, size_t *);
+void			 shrink_pool_free(struct shrink_pool *, void *, size_t);
+
+struct shrink_cdc;
+struct shrink_cdc	*shrink_cdc_init(struct shrink_ctx *, size_t, size_t,
+			     size_t);
+void			 shrink_cdc_cleanup(struct shrink_cdc *);
+void			 shrink_cdc_reset(struct shrink_cdc *);
+size_t			 shrink_cdc_cut(struct shrink_cdc *, const uint8_t *,
+			     size_t);
+int			 shrink_cdc_compress(struct shrink_cdc *, uint8_t *,
+			     uint8_t *, size_t, size_t *, struct shrink_chunk *,
+			     struct timeval *);
 
 /*
  * old api for compatibility. DO NOT USE IN NEW CODE!
@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# Copyright (c) 2026 Conformal Systems LLC <info@conformal.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+#
+# Compare two "shrink bench -f csv" runs.  Fails when throughput dropped
+# by more than the tolerance (percent, default 10) or the ratio got worse.
+#
+SCRIPT=bench_compare.sh
+if [ $# -lt 2 ]; then
+	echo "usage: $SCRIPT baseline.csv current.csv [tolerance]" 1>&2
+	exit 1
+fi
+BASE=$1
+CUR=$2
+TOL=${3:-10}
+
+# The quoted corpus name may contain commas, so fields are counted from
+# the end of the line; the key is everything up to the size column.
+awk -F, -v tol="$TOL" '
+function key(	i, k) {
+	k = $1
+	for (i = 2; i <= NF - 11; i++)
+		k = k "," $i
+	return (k)
+}
+NR == FNR {
+	if (FNR > 1) {
+		k = key()
+		ratio[k] = $(NF - 8)
+		comp[k] = $(NF - 7)
+		decomp[k] = $(NF - 6)
+	}
+	next
+}
+FNR == 1 { next }
+{
+	k = key()
+	r = $(NF - 8)
+	c = $(NF - 7)
+	d = $(NF - 6)
+	if (!(k in ratio)) {
+		printf("%-32s new\n", k)
+		next
+	}
+	msg = ""
+	if (r < ratio[k] * 0.999)
+		msg = msg sprintf(" ratio %.4f -> %.4f", ratio[k], r)
+	if (c < comp[k] * (100 - tol) / 100)
+		msg = msg sprintf(" compress %.1f -> %.1f MB/s", comp[k], c)
+	if (d < decomp[k] * (100 - tol) / 100)
+		msg = msg sprintf(" decompress %.1f -> %.1f MB/s", decomp[k], d)
+	if (msg != "") {
+		printf("%-32s REGRESSION%s\n", k, msg)
+		bad++
+	} else
+		printf("%-32s ok\n", k)
+}
+END {
+	if (bad) {
+		printf("%d regression(s)\n", bad)
+		exit 1
+	}
+}' "$BASE" "$CUR"
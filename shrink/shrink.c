@@ -27,14 +27,41 @@
 #include <err.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <openssl/sha.h>
 
 size_t			bs = 10 * 1024 * 1024;
-int			count = 1, random_data = 0;
+size_t			history = 0;
+int			count = 1, random_data = 0, mixed_data = 0;
+int			inplace = 0;
 char			*filename = NULL;
 
+/* every algorithm and level, in the order they are benchmarked */
+struct algo {
+	int			a_algo;
+	int			a_level;
+} algos[] = {
+	{ SHRINK_ALG_NULL,	SHRINK_L_NONE },
+	{ SHRINK_ALG_LZO,	SHRINK_L_MIN },
+	{ SHRINK_ALG_LZO,	SHRINK_L_MID },
+	{ SHRINK_ALG_LZO,	SHRINK_L_MAX },
+	{ SHRINK_ALG_LZW,	SHRINK_L_MIN },
+	{ SHRINK_ALG_LZW,	SHRINK_L_MID },
+	{ SHRINK_ALG_LZW,	SHRINK_L_MAX },
+	{ SHRINK_ALG_LZMA,	SHRINK_L_MIN },
+	{ SHRINK_ALG_LZMA,	SHRINK_L_MID },
+	{ SHRINK_ALG_LZMA,	SHRINK_L_MAX },
+};
+#define NALGOS			(sizeof(algos) / sizeof(algos[0]))
+
 void
 print_time_scaled(char *s, struct timeval *t)
 {
@@ -83,11 +110,11 @@ print_size(char *s, size_t sz)
 void
 test_run(int algo, int level)
 {
-	struct shrink_ctx	*ctx;
+	struct shrink_ctx	*ctx, *dctx;
 	struct timeval		elapsed, tot_comp, tot_uncomp;
 	uint8_t			*s = NULL, *d = NULL, *uncomp = NULL;
-	size_t			tot_comp_sz = 0, tot_uncomp_sz = 0, dsz;
-	size_t			uncomp_sz, comp_sz;
+	size_t			tot_comp_sz = 0, tot_uncomp_sz = 0, dsz, usz;
+	size_t			uncomp_sz, comp_sz, split;
 	int			i, restart = 0;
 
 	timerclear(&tot_comp);
@@ -98,6 +125,21 @@ test_run(int algo, int level)
 		return;
 	}
 
+	/* history lives in the context, decompress on a second one */
+	dctx = ctx;
+	if (history) {
+		if (shrink_set_history(ctx, history, 0)) {
+			warnx("%s: no history support",
+			    shrink_get_algorithm(ctx));
+			shrink_cleanup(ctx);
+			return;
+		}
+		if ((dctx = shrink_init(algo, level)) == NULL)
+			errx(1, "shrink_init");
+		if (shrink_set_history(dctx, history, 0))
+			errx(1, "shrink_set_history");
+	}
+
 	s = malloc(bs);
 	if (s == NULL)
 		err(1, "malloc s");
@@ -105,14 +147,23 @@ test_run(int algo, int level)
 	d = shrink_malloc(ctx, &dsz);
 	if (d == NULL)
 		err(1, "malloc d");
-	uncomp = malloc(bs);
+	usz = bs;
+	if (inplace)
+		uncomp = shrink_malloc_inplace(dctx, &usz);
+	else
+		uncomp = malloc(bs);
 	if (uncomp == NULL)
 		err(1, "malloc uncomp");
 
 	for (i = 0; i < count; i++) {
 		if (random_data)
 			arc4random_buf(s, bs);
-		else
+		else if (mixed_data) {
+			/* compressible head, incompressible tail, moving split */
+			split = bs / 10 * (1 + i % 9);
+			memset(s, i, split);
+			arc4random_buf(s + split, bs - split);
+		} else
 			memset(s, i, bs);
 
 		/* compress */
@@ -132,8 +183,14 @@ test_run(int algo, int level)
 
 		/* decompress */
 		uncomp_sz = bs;
-		if (shrink_decompress(ctx, d, uncomp, comp_sz, &uncomp_sz,
-		    &elapsed))
+		if (inplace) {
+			/* compressed data sits at the end of the buffer */
+			memcpy(uncomp + usz - comp_sz, d, comp_sz);
+			if (shrink_decompress_inplace(dctx, uncomp, usz,
+			    comp_sz, &uncomp_sz, &elapsed))
+				errx(1, "shrink_decompress_inplace");
+		} else if (shrink_decompress(dctx, d, uncomp, comp_sz,
+		    &uncomp_sz, &elapsed))
 			errx(1, "shrink_decompress");
 		timeradd(&elapsed, &tot_uncomp, &tot_uncomp);
 		tot_uncomp_sz += uncomp_sz;
@@ -157,6 +214,8 @@ test_run(int algo, int level)
 	free(s);
 	free(d);
 	free(uncomp);
+	if (dctx != ctx)
+		shrink_cleanup(dctx);
 	shrink_cleanup(ctx);
 }
 
@@ -164,43 +223,48 @@ void
 test_file(void)
 {
 	struct shrink_ctx	*ctx;
+	struct shrink_pool	*pool;
 	int			i;
 	FILE			*f;
 	struct stat		sb;
 	uint8_t			*s1, *s2, *c1, *c2, *d1, *d2;
 	size_t			c1sz, c2sz, comp_sz1, comp_sz2;
-	size_t			uncomp_sz1, uncomp_sz2;
+	size_t			uncomp_sz1, uncomp_sz2, sz;
 	uint8_t			sha1[SHA_DIGEST_LENGTH];
 	uint8_t			sha2[SHA_DIGEST_LENGTH];
 	SHA_CTX			ctx1, ctx2;
 
 	if ((ctx = shrink_init(SHRINK_ALG_LZO, SHRINK_L_MID)) == NULL)
 		errx(1, "shrink_init");
+	if ((pool = shrink_pool_init(SHRINK_ALIGN_PAGE,
+	    SHRINK_POOL_HUGE)) == NULL)
+		errx(1, "shrink_pool_init");
 
 	/* XXX yeah yeah yeah it's a race */
 	if (stat(filename, &sb))
 		err(1, "stat");
 
 	for (i = 0; i < count; i++) {
-		/* get memory */
-		s1 = malloc(sb.st_size);
+		/* get memory, recycled from the previous run */
+		sz = sb.st_size;
+		s1 = shrink_pool_malloc(pool, NULL, &sz);
 		if (s1 == NULL)
 			err(1, "malloc");
-		s2 = malloc(sb.st_size);
+		s2 = shrink_pool_malloc(pool, NULL, &sz);
 		if (s2 == NULL)
 			err(1, "malloc");
 		c1sz = sb.st_size;
-		c1 = shrink_malloc(ctx, &c1sz);
+		c1 = shrink_pool_malloc(pool, ctx, &c1sz);
 		if (c1 == NULL)
 			err(1, "malloc");
 		c2sz = sb.st_size;
-		c2 = shrink_malloc(ctx, &c2sz);
+		c2 = shrink_pool_malloc(pool, ctx, &c2sz);
 		if (c2 == NULL)
 			err(1, "malloc");
-		d1 = malloc(sb.st_size);
+		d1 = shrink_pool_malloc(pool, NULL, &sz);
 		if (d1 == NULL)
 			err(1, "malloc");
-		d2 = malloc(sb.st_size);
+		d2 = shrink_pool_malloc(pool, NULL, &sz);
 		if (d2 == NULL)
 			err(1, "malloc");
 
@@ -274,22 +338,1279 @@ test_file(void)
 			printf("run %d\n", i);
 
 		/* and return it */
-		free(c1);
-		free(c2);
-		free(d1);
-		free(d2);
-		free(s1);
-		free(s2);
+		shrink_pool_free(pool, c1, c1sz);
+		shrink_pool_free(pool, c2, c2sz);
+		shrink_pool_free(pool, d1, sz);
+		shrink_pool_free(pool, d2, sz);
+		shrink_pool_free(pool, s1, sz);
+		shrink_pool_free(pool, s2, sz);
 	}
+	shrink_pool_cleanup(pool);
 	shrink_cleanup(ctx);
 }
 
+/*
+ * File mode.  The output is a 16 byte file header followed by records of a
+ * little endian 32 bit uncompressed size, a 32 bit compressed size and the
+ * compressed block.  A record with an uncompressed size of 0 ends the file.
+ *
+ *	0-3	magic
+ *	4	version
+ *	5	algorithm
+ *	6	level
+ *	7	reserved
+ *	8-11	block size
+ *	12-15	reserved
+ */
+#define FILE_MAGIC		"SHRK"
+#define FILE_VERSION		(1)
+#define FILE_HDR_SZ		(16)
+#define REC_HDR_SZ		(8)
+
+#define MODE_COMPRESS		(0)
+#define MODE_DECOMPRESS		(1)
+
+struct slot {
+	uint8_t			*buf;
+	size_t			bufsz;
+	uint8_t			*data;	/* buf or inside the mapped input */
+	size_t			len;
+	size_t			ulen;	/* uncompressed size of a record */
+	uint64_t		seq;
+	int			eof;
+};
+
+struct queue {
+	pthread_mutex_t		q_mtx;
+	pthread_cond_t		q_cv;
+	struct slot		**q_slot;
+	int			q_max;
+	int			q_head;
+	int			q_count;
+};
+
+struct job {
+	int			j_mode;
+	int			j_algo;
+	int			j_level;
+	size_t			j_bs;
+	int			j_in;
+	int			j_out;
+	uint8_t			*j_map;	/* mapped input, if any */
+	size_t			j_mapsz;
+	size_t			j_off;	/* read position in the map */
+	int			j_nslots;
+	struct queue		j_in_free;
+	struct queue		j_in_full;
+	struct queue		j_out_free;
+	struct queue		j_out_full;
+};
+
+/*
+ * The input map is released by exit handler so the err(3) paths in main
+ * release it too.  Not while the pipeline threads may still be reading it.
+ */
+struct job			*mapped_job;
+int				mapped_busy;
+
+void
+unmap_input(void)
+{
+	if (mapped_job == NULL || mapped_busy)
+		return;
+	munmap(mapped_job->j_map, mapped_job->j_mapsz);
+	mapped_job->j_map = NULL;
+	mapped_job = NULL;
+}
+
+struct worker {
+	struct job		*w_job;
+	struct shrink_ctx	*w_ctx;
+	pthread_t		w_thread;
+	struct timeval		w_busy;
+	uint64_t		w_bytes;	/* uncompressed */
+	uint64_t		w_blocks;
+};
+
+void
+q_init(struct queue *q, int max)
+{
+	if (pthread_mutex_init(&q->q_mtx, NULL))
+		errx(1, "pthread_mutex_init");
+	if (pthread_cond_init(&q->q_cv, NULL))
+		errx(1, "pthread_cond_init");
+	if ((q->q_slot = calloc(max, sizeof(*q->q_slot))) == NULL)
+		err(1, "calloc");
+	q->q_max = max;
+	q->q_head = 0;
+	q->q_count = 0;
+}
+
+void
+q_put(struct queue *q, struct slot *s)
+{
+	pthread_mutex_lock(&q->q_mtx);
+	if (q->q_count == q->q_max)
+		errx(1, "queue overflow");
+	q->q_slot[(q->q_head + q->q_count++) % q->q_max] = s;
+	pthread_cond_signal(&q->q_cv);
+	pthread_mutex_unlock(&q->q_mtx);
+}
+
+struct slot *
+q_get(struct queue *q)
+{
+	struct slot		*s;
+
+	pthread_mutex_lock(&q->q_mtx);
+	while (q->q_count == 0)
+		pthread_cond_wait(&q->q_cv, &q->q_mtx);
+	s = q->q_slot[q->q_head];
+	q->q_head = (q->q_head + 1) % q->q_max;
+	q->q_count--;
+	pthread_mutex_unlock(&q->q_mtx);
+
+	return (s);
+}
+
+void
+put32le(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+uint32_t
+get32le(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	    (uint32_t)p[3] << 24);
+}
+
+void
+write_all(int fd, const uint8_t *p, size_t len)
+{
+	ssize_t			w;
+
+	while (len > 0) {
+		if ((w = write(fd, p, len)) == -1)
+			err(1, "write");
+		p += w;
+		len -= w;
+	}
+}
+
+/* returns less than len only at end of file */
+size_t
+read_all(int fd, uint8_t *p, size_t len)
+{
+	ssize_t			r;
+	size_t			tot = 0;
+
+	while (tot < len) {
+		if ((r = read(fd, p + tot, len - tot)) == -1)
+			err(1, "read");
+		if (r == 0)
+			break;
+		tot += r;
+	}
+
+	return (tot);
+}
+
+/* get the next len bytes of input, from the map or into buf */
+uint8_t *
+job_read(struct job *j, uint8_t *buf, size_t len, size_t *got)
+{
+	uint8_t			*p;
+
+	if (j->j_map == NULL) {
+		*got = read_all(j->j_in, buf, len);
+		return (buf);
+	}
+
+	if (len > j->j_mapsz - j->j_off)
+		len = j->j_mapsz - j->j_off;
+	p = j->j_map + j->j_off;
+	j->j_off += len;
+	*got = len;
+
+	return (p);
+}
+
+/* reader thread: fill input slots while the previous ones are worked on */
+void *
+reader(void *arg)
+{
+	struct job		*j = arg;
+	struct slot		*s;
+	uint8_t			rec[REC_HDR_SZ], *p;
+	uint64_t		seq;
+	size_t			got;
+
+	for (seq = 0;; seq++) {
+		s = q_get(&j->j_in_free);
+		s->seq = seq;
+		s->eof = 0;
+
+		if (j->j_mode == MODE_COMPRESS) {
+			s->data = job_read(j, s->buf, j->j_bs, &s->len);
+			s->eof = s->len == 0;
+		} else {
+			p = job_read(j, rec, sizeof(rec), &got);
+			if (got != sizeof(rec))
+				errx(1, "truncated input");
+			s->ulen = get32le(p);
+			s->len = get32le(p + 4);
+			if (s->ulen == 0)
+				s->eof = 1;
+			else if (s->ulen > j->j_bs || s->len > s->bufsz)
+				errx(1, "corrupt input");
+			else {
+				s->data = job_read(j, s->buf, s->len, &got);
+				if (got != s->len)
+					errx(1, "truncated input");
+			}
+		}
+
+		/* start paging in the next block */
+		if (j->j_map && j->j_off < j->j_mapsz)
+			madvise(j->j_map + j->j_off, MIN(j->j_bs,
+			    j->j_mapsz - j->j_off), MADV_WILLNEED);
+
+		q_put(&j->j_in_full, s);
+		if (s->eof)
+			break;
+	}
+
+	return (NULL);
+}
+
+/*
+ * writer thread: write output slots in order while the next ones are worked
+ * on.  Workers finish out of order so blocks are held in a reorder buffer
+ * until it is their turn.  Blocks in flight never outnumber output slots so
+ * one entry per slot is enough.
+ */
+void *
+writer(void *arg)
+{
+	struct job		*j = arg;
+	struct slot		*s, **pending;
+	uint64_t		next = 0;
+
+	if ((pending = calloc(j->j_nslots, sizeof(*pending))) == NULL)
+		err(1, "calloc");
+
+	for (;;) {
+		s = q_get(&j->j_out_full);
+		if (s->eof)
+			break;
+		pending[s->seq % j->j_nslots] = s;
+		while ((s = pending[next % j->j_nslots]) != NULL &&
+		    s->seq == next) {
+			pending[next % j->j_nslots] = NULL;
+			write_all(j->j_out, s->buf, s->len);
+			q_put(&j->j_out_free, s);
+			next++;
+		}
+	}
+	free(pending);
+
+	return (NULL);
+}
+
+/*
+ * worker thread.  The output slot is taken before the input slot; input is
+ * handed out in order so the oldest block in flight always has somewhere to
+ * go and the reorder buffer can not starve the workers.
+ */
+void *
+work(void *arg)
+{
+	struct worker		*w = arg;
+	struct job		*j = w->w_job;
+	struct shrink_ctx	*ctx = w->w_ctx;
+	struct slot		*in, *out;
+	struct timeval		elapsed;
+	size_t			sz;
+
+	for (;;) {
+		out = q_get(&j->j_out_free);
+		in = q_get(&j->j_in_full);
+		if (in->eof) {
+			/* pass it on to the other workers */
+			q_put(&j->j_in_full, in);
+			q_put(&j->j_out_free, out);
+			break;
+		}
+
+		if (j->j_mode == MODE_COMPRESS) {
+			sz = out->bufsz - REC_HDR_SZ;
+			if (shrink_compress(ctx, in->data,
+			    out->buf + REC_HDR_SZ, in->len, &sz, &elapsed))
+				errx(1, "shrink_compress");
+			put32le(out->buf, in->len);
+			put32le(out->buf + 4, sz);
+			out->len = sz + REC_HDR_SZ;
+			w->w_bytes += in->len;
+		} else {
+			sz = in->ulen;
+			if (shrink_decompress(ctx, in->data, out->buf, in->len,
+			    &sz, &elapsed))
+				errx(1, "shrink_decompress");
+			if (sz != in->ulen)
+				errx(1, "corrupt input");
+			out->len = sz;
+			w->w_bytes += sz;
+		}
+		out->seq = in->seq;
+		timeradd(&w->w_busy, &elapsed, &w->w_busy);
+		w->w_blocks++;
+
+		q_put(&j->j_in_free, in);
+		q_put(&j->j_out_full, out);
+	}
+
+	return (NULL);
+}
+
+void
+report(struct worker *w, int nworkers, struct timeval *wall)
+{
+	struct timeval		busy;
+	uint64_t		bytes = 0;
+	double			us;
+	char			human[64];
+	int			i;
+
+	timerclear(&busy);
+	for (i = 0; i < nworkers; i++) {
+		us = (double)w[i].w_busy.tv_sec * 1000000.0 +
+		    w[i].w_busy.tv_usec;
+		fmt_scaled(w[i].w_bytes * 1000000.0 / (us ? us : 1), human);
+		fprintf(stderr, "thread %3d: %8llu blocks %13sB/s\n", i,
+		    (unsigned long long)w[i].w_blocks, human);
+		bytes += w[i].w_bytes;
+		timeradd(&busy, &w[i].w_busy, &busy);
+	}
+
+	us = (double)wall->tv_sec * 1000000.0 + wall->tv_usec;
+	fmt_scaled(bytes * 1000000.0 / (us ? us : 1), human);
+	fprintf(stderr, "aggregate : %13sB/s\n", human);
+	us = (double)busy.tv_sec * 1000000.0 + busy.tv_usec;
+	fmt_scaled(bytes * 1000000.0 / (us ? us : 1), human);
+	fprintf(stderr, "per thread: %13sB/s\n", human);
+}
+
+int
+parse_algo(const char *s)
+{
+	if (!strcmp(s, "null"))
+		return (SHRINK_ALG_NULL);
+	if (!strcmp(s, "lzo"))
+		return (SHRINK_ALG_LZO);
+	if (!strcmp(s, "lzw"))
+		return (SHRINK_ALG_LZW);
+	if (!strcmp(s, "lzma"))
+		return (SHRINK_ALG_LZMA);
+	errx(1, "invalid algorithm %s", s);
+}
+
+void
+usage(void)
+{
+	extern char		*__progname;
+
+	fprintf(stderr, "usage: %s [-imr] [-b blocksize] [-c count] "
+	    "[-f file] [-H history]\n", __progname);
+	fprintf(stderr, "       %s compress [-v] [-a algorithm] "
+	    "[-b blocksize] [-j threads] [-l level] [in [out]]\n",
+	    __progname);
+	fprintf(stderr, "       %s decompress [-v] [-j threads] [in [out]]\n",
+	    __progname);
+	fprintf(stderr, "       %s bench [-a algorithm] [-b blocksize] "
+	    "[-d dir] [-f text|csv|json]\n"
+	    "             [-n iterations] [-s size] [-w warmup]\n",
+	    __progname);
+	fprintf(stderr, "       %s scale [-a algorithm] [-b blocksize] "
+	    "[-r seconds] [-s size] [-t threads]\n", __progname);
+	exit(1);
+}
+
+int
+file_mode(int mode, int argc, char *argv[])
+{
+	struct job		j;
+	struct worker		*w;
+	struct slot		*s;
+	struct stat		sb;
+	struct timeval		start, end, wall;
+	pthread_t		rt, wt;
+	uint8_t			hdr[FILE_HDR_SZ], *p;
+	size_t			got;
+	int			c, i, nworkers = 1, verbose = 0;
+
+	bzero(&j, sizeof(j));
+	j.j_mode = mode;
+	j.j_algo = SHRINK_ALG_LZO;
+	j.j_level = SHRINK_L_MID;
+	j.j_bs = 1024 * 1024;
+	j.j_in = STDIN_FILENO;
+	j.j_out = STDOUT_FILENO;
+
+	while ((c = getopt(argc, argv,
+	    mode == MODE_COMPRESS ? "a:b:j:l:v" : "j:v")) != -1) {
+		switch (c) {
+		case 'j':
+			nworkers = atoi(optarg);
+			if (nworkers <= 0 || nworkers > 1024)
+				errx(1, "invalid number of threads");
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'a':
+			j.j_algo = parse_algo(optarg);
+			break;
+		case 'b':
+			j.j_bs = atoi(optarg);
+			if (j.j_bs <= 0 || j.j_bs > 1024 * 1024 * 1024)
+				errx(1, "invalid block size");
+			break;
+		case 'l':
+			j.j_level = atoi(optarg);
+			if (j.j_level < SHRINK_L_NONE ||
+			    j.j_level > SHRINK_L_MAX)
+				errx(1, "invalid level");
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 2)
+		usage();
+	if (j.j_algo == SHRINK_ALG_NULL)
+		j.j_level = SHRINK_L_NONE;
+	else if (j.j_level == SHRINK_L_NONE)
+		errx(1, "level 0 is only valid for the null algorithm");
+
+	if (argc > 0 && strcmp(argv[0], "-"))
+		if ((j.j_in = open(argv[0], O_RDONLY)) == -1)
+			err(1, "%s", argv[0]);
+	if (argc > 1 && strcmp(argv[1], "-"))
+		if ((j.j_out = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC,
+		    0644)) == -1)
+			err(1, "%s", argv[1]);
+
+	/* zero copy input for regular files */
+	if (fstat(j.j_in, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		j.j_map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED,
+		    j.j_in, 0);
+		if (j.j_map == MAP_FAILED)
+			j.j_map = NULL;
+		else {
+			j.j_mapsz = sb.st_size;
+			madvise(j.j_map, j.j_mapsz, MADV_SEQUENTIAL);
+			mapped_job = &j;
+			atexit(unmap_input);
+		}
+	}
+
+	if (mode == MODE_COMPRESS) {
+		bcopy(FILE_MAGIC, hdr, 4);
+		hdr[4] = FILE_VERSION;
+		hdr[5] = j.j_algo;
+		hdr[6] = j.j_level;
+		hdr[7] = 0;
+		put32le(hdr + 8, j.j_bs);
+		put32le(hdr + 12, 0);
+		write_all(j.j_out, hdr, sizeof(hdr));
+	} else {
+		p = job_read(&j, hdr, sizeof(hdr), &got);
+		if (got != sizeof(hdr) || bcmp(p, FILE_MAGIC, 4) ||
+		    p[4] != FILE_VERSION)
+			errx(1, "not a shrink file");
+		j.j_algo = p[5];
+		j.j_level = p[6];
+		j.j_bs = get32le(p + 8);
+		if (j.j_bs == 0 || j.j_bs > 1024 * 1024 * 1024)
+			errx(1, "invalid block size");
+	}
+
+	/* every worker gets its own context */
+	if ((w = calloc(nworkers, sizeof(*w))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nworkers; i++) {
+		w[i].w_job = &j;
+		if ((w[i].w_ctx = shrink_init(j.j_algo, j.j_level)) == NULL)
+			errx(1, "shrink_init algorithm %d not supported",
+			    j.j_algo);
+		if (shrink_set_checksum(w[i].w_ctx, SHRINK_CSUM_CRC32C))
+			errx(1, "shrink_set_checksum");
+	}
+
+	/* two slots per worker so I/O runs while the others are worked on */
+	j.j_nslots = 2 * nworkers;
+	q_init(&j.j_in_free, j.j_nslots + 1);
+	q_init(&j.j_in_full, j.j_nslots + 1);
+	q_init(&j.j_out_free, j.j_nslots + 1);
+	q_init(&j.j_out_full, j.j_nslots + 1);
+	for (i = 0; i < j.j_nslots; i++) {
+		if ((s = calloc(1, sizeof(*s))) == NULL)
+			err(1, "calloc");
+		s->bufsz = mode == MODE_COMPRESS ? j.j_bs :
+		    shrink_compress_bounds(w[0].w_ctx, j.j_bs);
+		if (j.j_map == NULL && (s->buf = malloc(s->bufsz)) == NULL)
+			err(1, "malloc");
+		q_put(&j.j_in_free, s);
+
+		if ((s = calloc(1, sizeof(*s))) == NULL)
+			err(1, "calloc");
+		s->bufsz = mode == MODE_COMPRESS ?
+		    shrink_compress_bounds(w[0].w_ctx, j.j_bs) + REC_HDR_SZ :
+		    j.j_bs;
+		if ((s->buf = malloc(s->bufsz)) == NULL)
+			err(1, "malloc");
+		q_put(&j.j_out_free, s);
+	}
+
+	if (gettimeofday(&start, NULL) == -1)
+		err(1, "gettimeofday");
+	mapped_busy = 1;
+	if (pthread_create(&rt, NULL, reader, &j))
+		errx(1, "pthread_create");
+	if (pthread_create(&wt, NULL, writer, &j))
+		errx(1, "pthread_create");
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&w[i].w_thread, NULL, work, &w[i]))
+			errx(1, "pthread_create");
+	for (i = 0; i < nworkers; i++)
+		pthread_join(w[i].w_thread, NULL);
+
+	/* all blocks are queued, tell the writer to finish */
+	s = q_get(&j.j_out_free);
+	s->eof = 1;
+	q_put(&j.j_out_full, s);
+	pthread_join(rt, NULL);
+	pthread_join(wt, NULL);
+	mapped_busy = 0;
+	unmap_input();
+	if (gettimeofday(&end, NULL) == -1)
+		err(1, "gettimeofday");
+	timersub(&end, &start, &wall);
+
+	if (mode == MODE_COMPRESS) {
+		bzero(hdr, REC_HDR_SZ);
+		write_all(j.j_out, hdr, REC_HDR_SZ);
+	}
+	if (j.j_out != STDOUT_FILENO && close(j.j_out))
+		err(1, "close");
+
+	if (verbose)
+		report(w, nworkers, &wall);
+	for (i = 0; i < nworkers; i++)
+		shrink_cleanup(w[i].w_ctx);
+	free(w);
+	return (0);
+}
+
+/*
+ * Benchmark mode.  Runs every algorithm over a set of corpora, either the
+ * files in a directory or generated text, log and binary data.  Generated
+ * data comes from a fixed seed so runs are comparable across machines and
+ * over time.
+ */
+#define FMT_TEXT		(0)
+#define FMT_CSV			(1)
+#define FMT_JSON		(2)
+
+struct corpus {
+	char			c_name[256];
+	uint8_t			*c_data;
+	size_t			c_len;
+};
+
+struct result {
+	const char		*r_algorithm;
+	size_t			r_size;
+	size_t			r_comp_sz;
+	double			r_comp_mbps;
+	double			r_decomp_mbps;
+	double			r_comp_lat[3];	/* p50, p99, max in us */
+	double			r_decomp_lat[3];
+};
+
+/* xorshift64*, good enough for filler data and reproducible */
+uint64_t
+rnd_next(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * 0x2545f4914f6cdd1dULL);
+}
+
+const char *words[] = {
+	"the", "of", "and", "to", "in", "a", "is", "that", "for", "it",
+	"as", "was", "with", "be", "by", "on", "not", "he", "this", "are",
+	"or", "his", "from", "at", "which", "but", "have", "an", "had",
+	"they", "you", "were", "their", "one", "all", "we", "can", "her",
+	"has", "there", "been", "if", "more", "when", "will", "would",
+	"who", "so", "no", "compression", "block", "buffer", "algorithm",
+	"memory", "throughput", "latency", "archive", "stream", "window",
+	"dictionary", "entropy", "checksum", "thread", "context",
+};
+#define NWORDS			(sizeof(words) / sizeof(words[0]))
+
+void
+gen_text(uint8_t *p, size_t len, uint64_t *st)
+{
+	size_t			off = 0, n;
+	uint64_t		r1, r2;
+	const char		*w;
+	int			nw = 0;
+
+	while (off < len) {
+		/*
+		 * Skew towards the front of the list like real text.  One
+		 * rnd_next() per statement, C leaves the order of calls in an
+		 * expression unspecified and the corpus must not depend on it.
+		 */
+		r1 = rnd_next(st);
+		r2 = rnd_next(st);
+		w = words[r2 % (r1 % NWORDS + 1)];
+		n = MIN(strlen(w), len - off);
+		memcpy(p + off, w, n);
+		off += n;
+		if (off < len)
+			p[off++] = ++nw % 12 == 0 ? '\n' : ' ';
+	}
+}
+
+void
+gen_log(uint8_t *p, size_t len, uint64_t *st)
+{
+	const char		*lvl[] = { "info", "info", "info", "warn",
+				    "debug", "error" };
+	const char		*path[] = { "users", "orders", "blocks",
+				    "health", "metrics" };
+	char			line[256];
+	size_t			off = 0, n;
+	uint64_t		ts = 1700000000000ULL, r[8];
+	int			i;
+
+	while (off < len) {
+		ts += rnd_next(st) % 50;
+		/* fixed draw order, see gen_text */
+		for (i = 0; i < 8; i++)
+			r[i] = rnd_next(st);
+		n = snprintf(line, sizeof(line), "%llu.%03llu host-%02d "
+		    "app[%d]: level=%s req=%08x path=/api/v1/%s/%u "
+		    "status=%d dur=%dms\n",
+		    (unsigned long long)ts / 1000,
+		    (unsigned long long)ts % 1000,
+		    (int)(r[0] % 16), 1000 + (int)(r[1] % 8),
+		    lvl[r[2] % 6], (unsigned)r[3],
+		    path[r[4] % 5], (unsigned)(r[5] % 100000),
+		    r[6] % 10 ? 200 : 500,
+		    (int)(r[7] % 250));
+		n = MIN(n, len - off);
+		memcpy(p + off, line, n);
+		off += n;
+	}
+}
+
+/* fixed size records: counters, flags, a random walk and some noise */
+void
+gen_binary(uint8_t *p, size_t len, uint64_t *st)
+{
+	uint8_t			rec[32];
+	uint64_t		id = 0, r;
+	size_t			off = 0, n;
+	float			v = 0;
+
+	while (off < len) {
+		id += 1 + rnd_next(st) % 3;
+		r = rnd_next(st);
+		v += (float)((int)(r % 2001) - 1000) / 1000.0f;
+		memcpy(rec, &id, 8);
+		put32le(rec + 8, 1 << (r >> 32) % 4);
+		memcpy(rec + 12, &v, 4);
+		put32le(rec + 16, (uint32_t)(r >> 40) % 256);
+		put32le(rec + 20, (uint32_t)id * 7);
+		r = rnd_next(st);
+		memcpy(rec + 24, &r, 8);
+		n = MIN(sizeof(rec), len - off);
+		memcpy(p + off, rec, n);
+		off += n;
+	}
+}
+
+struct gen {
+	const char		*g_name;
+	void			(*g_fn)(uint8_t *, size_t, uint64_t *);
+} gens[] = {
+	{ "text",	gen_text },
+	{ "log",	gen_log },
+	{ "binary",	gen_binary },
+};
+#define NGENS			(sizeof(gens) / sizeof(gens[0]))
+
+int
+load_corpora(const char *dir, size_t gensz, struct corpus **cp)
+{
+	struct corpus		*c;
+	struct dirent		**de;
+	struct stat		sb;
+	char			path[PATH_MAX];
+	uint64_t		st;
+	int			i, n, fd, nc = 0;
+	size_t			got;
+
+	if (dir == NULL) {
+		if ((c = calloc(NGENS, sizeof(*c))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < NGENS; i++) {
+			strlcpy(c[i].c_name, gens[i].g_name,
+			    sizeof(c[i].c_name));
+			c[i].c_len = gensz;
+			if ((c[i].c_data = malloc(gensz)) == NULL)
+				err(1, "malloc");
+			st = 0x9e3779b97f4a7c15ULL * (i + 1);
+			gens[i].g_fn(c[i].c_data, gensz, &st);
+		}
+		*cp = c;
+		return (NGENS);
+	}
+
+	/* sorted so the output order is stable */
+	if ((n = scandir(dir, &de, NULL, alphasort)) == -1)
+		err(1, "%s", dir);
+	if ((c = calloc(n, sizeof(*c))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, de[i]->d_name);
+		free(de[i]);
+		if (stat(path, &sb) || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+			continue;
+		if ((fd = open(path, O_RDONLY)) == -1)
+			err(1, "%s", path);
+		c[nc].c_len = sb.st_size;
+		if ((c[nc].c_data = malloc(c[nc].c_len)) == NULL)
+			err(1, "malloc");
+		got = read_all(fd, c[nc].c_data, c[nc].c_len);
+		close(fd);
+		if (got != c[nc].c_len)
+			errx(1, "%s: short read", path);
+		strlcpy(c[nc].c_name, path + strlen(dir) + 1,
+		    sizeof(c[nc].c_name));
+		nc++;
+	}
+	free(de);
+	if (nc == 0)
+		errx(1, "%s: no files", dir);
+	*cp = c;
+
+	return (nc);
+}
+
+double
+now_us(void)
+{
+	struct timespec		ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return ((double)ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0);
+}
+
+int
+cmp_double(const void *a, const void *b)
+{
+	double			x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/* p50, p99 and max; sorts lat */
+void
+percentiles(double *lat, size_t n, double *out)
+{
+	qsort(lat, n, sizeof(*lat), cmp_double);
+	out[0] = lat[(n - 1) * 50 / 100];
+	out[1] = lat[(n - 1) * 99 / 100];
+	out[2] = lat[n - 1];
+}
+
+int
+bench_one(struct corpus *c, struct algo *a, size_t blksz, int iters,
+    int warmup, struct result *r)
+{
+	struct shrink_ctx	*ctx;
+	uint8_t			*comp, *uncomp;
+	size_t			nblk, b, off, len, csz, usz, dsz;
+	double			*clat, *dlat, t, ctot = 0, dtot = 0;
+	int			i;
+
+	if ((ctx = shrink_init(a->a_algo, a->a_level)) == NULL)
+		return (-1);
+
+	nblk = (c->c_len + blksz - 1) / blksz;
+	dsz = blksz;
+	if ((comp = shrink_malloc(ctx, &dsz)) == NULL)
+		err(1, "shrink_malloc");
+	if ((uncomp = malloc(blksz)) == NULL)
+		err(1, "malloc");
+	if ((clat = calloc(nblk * iters, sizeof(*clat))) == NULL ||
+	    (dlat = calloc(nblk * iters, sizeof(*dlat))) == NULL)
+		err(1, "calloc");
+
+	r->r_algorithm = shrink_get_algorithm(ctx);
+	r->r_size = c->c_len;
+	r->r_comp_sz = 0;
+	for (i = -warmup; i < iters; i++) {
+		for (b = 0, off = 0; b < nblk; b++, off += len) {
+			len = MIN(blksz, c->c_len - off);
+
+			csz = dsz;
+			t = now_us();
+			if (shrink_compress(ctx, c->c_data + off, comp, len,
+			    &csz, NULL))
+				errx(1, "shrink_compress");
+			t = now_us() - t;
+			if (i >= 0) {
+				clat[i * nblk + b] = t;
+				ctot += t;
+			}
+			if (i == 0)
+				r->r_comp_sz += csz;
+
+			usz = len;
+			t = now_us();
+			if (shrink_decompress(ctx, comp, uncomp, csz, &usz,
+			    NULL))
+				errx(1, "shrink_decompress");
+			t = now_us() - t;
+			if (i >= 0) {
+				dlat[i * nblk + b] = t;
+				dtot += t;
+			}
+			if (usz != len || bcmp(uncomp, c->c_data + off, len))
+				errx(1, "data corruption");
+		}
+	}
+
+	r->r_comp_mbps = (double)c->c_len * iters / (ctot ? ctot : 1);
+	r->r_decomp_mbps = (double)c->c_len * iters / (dtot ? dtot : 1);
+	percentiles(clat, nblk * iters, r->r_comp_lat);
+	percentiles(dlat, nblk * iters, r->r_decomp_lat);
+
+	free(clat);
+	free(dlat);
+	free(comp);
+	free(uncomp);
+	shrink_cleanup(ctx);
+
+	return (0);
+}
+
+/* corpus names can be any file name */
+void
+print_quoted(int fmt, const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"')
+			fputs(fmt == FMT_CSV ? "\"\"" : "\\\"", stdout);
+		else if (fmt == FMT_JSON && *s == '\\')
+			fputs("\\\\", stdout);
+		else if (fmt == FMT_JSON && (unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+void
+bench_print(int fmt, struct corpus *c, struct result *r, int first)
+{
+	switch (fmt) {
+	case FMT_TEXT:
+		printf("%-16.16s %-12s %7.3f %9.1f %9.1f %9.1f %9.1f %9.1f "
+		    "%9.1f %9.1f %9.1f\n", c->c_name, r->r_algorithm,
+		    (double)r->r_size / (r->r_comp_sz ? r->r_comp_sz : 1),
+		    r->r_comp_mbps, r->r_decomp_mbps,
+		    r->r_comp_lat[0], r->r_comp_lat[1], r->r_comp_lat[2],
+		    r->r_decomp_lat[0], r->r_decomp_lat[1],
+		    r->r_decomp_lat[2]);
+		break;
+	case FMT_CSV:
+		print_quoted(fmt, c->c_name);
+		printf(",%s,%zu,%zu,%.4f,%.2f,%.2f,%.1f,%.1f,%.1f,%.1f,"
+		    "%.1f,%.1f\n", r->r_algorithm, r->r_size,
+		    r->r_comp_sz,
+		    (double)r->r_size / (r->r_comp_sz ? r->r_comp_sz : 1),
+		    r->r_comp_mbps, r->r_decomp_mbps,
+		    r->r_comp_lat[0], r->r_comp_lat[1], r->r_comp_lat[2],
+		    r->r_decomp_lat[0], r->r_decomp_lat[1],
+		    r->r_decomp_lat[2]);
+		break;
+	case FMT_JSON:
+		printf("%s\n  { \"corpus\": ", first ? "" : ",");
+		print_quoted(fmt, c->c_name);
+		printf(", \"algorithm\": \"%s\", "
+		    "\"size\": %zu, \"compressed\": %zu, \"ratio\": %.4f,\n"
+		    "    \"compress_mbps\": %.2f, \"decompress_mbps\": %.2f,\n"
+		    "    \"compress_us\": { \"p50\": %.1f, \"p99\": %.1f, "
+		    "\"max\": %.1f },\n"
+		    "    \"decompress_us\": { \"p50\": %.1f, \"p99\": %.1f, "
+		    "\"max\": %.1f } }",
+		    r->r_algorithm, r->r_size, r->r_comp_sz,
+		    (double)r->r_size / (r->r_comp_sz ? r->r_comp_sz : 1),
+		    r->r_comp_mbps, r->r_decomp_mbps,
+		    r->r_comp_lat[0], r->r_comp_lat[1], r->r_comp_lat[2],
+		    r->r_decomp_lat[0], r->r_decomp_lat[1],
+		    r->r_decomp_lat[2]);
+		break;
+	}
+}
+
+int
+bench_mode(int argc, char *argv[])
+{
+	struct corpus		*corp;
+	struct result		r;
+	const char		*dir = NULL;
+	size_t			blksz = 64 * 1024, gensz = 8 * 1024 * 1024;
+	int			c, i, k, ncorp, iters = 5, warmup = 1, first = 1;
+	int			fmt = FMT_TEXT, only = -1;
+
+	while ((c = getopt(argc, argv, "a:b:d:f:n:s:w:")) != -1) {
+		switch (c) {
+		case 'a':
+			only = parse_algo(optarg);
+			break;
+		case 'b':
+			blksz = atoi(optarg);
+			if (blksz <= 0 || blksz > 1024 * 1024 * 1024)
+				errx(1, "invalid block size");
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				fmt = FMT_TEXT;
+			else if (!strcmp(optarg, "csv"))
+				fmt = FMT_CSV;
+			else if (!strcmp(optarg, "json"))
+				fmt = FMT_JSON;
+			else
+				errx(1, "invalid format %s", optarg);
+			break;
+		case 'n':
+			iters = atoi(optarg);
+			if (iters <= 0 || iters > 1000000)
+				errx(1, "invalid iterations");
+			break;
+		case 's':
+			gensz = atoi(optarg);
+			if (gensz <= 0 || gensz > 1024 * 1024 * 1024)
+				errx(1, "invalid corpus size");
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			if (warmup < 0 || warmup > 1000000)
+				errx(1, "invalid warmup");
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	ncorp = load_corpora(dir, gensz, &corp);
+
+	switch (fmt) {
+	case FMT_TEXT:
+		printf("%-16s %-12s %7s %9s %9s %9s %9s %9s %9s %9s %9s\n",
+		    "corpus", "algorithm", "ratio", "comp MB/s", "dec MB/s",
+		    "c p50 us", "c p99 us", "c max us", "d p50 us", "d p99 us",
+		    "d max us");
+		break;
+	case FMT_CSV:
+		printf("corpus,algorithm,size,compressed,ratio,compress_mbps,"
+		    "decompress_mbps,compress_p50_us,compress_p99_us,"
+		    "compress_max_us,decompress_p50_us,decompress_p99_us,"
+		    "decompress_max_us\n");
+		break;
+	case FMT_JSON:
+		printf("[");
+		break;
+	}
+
+	for (i = 0; i < ncorp; i++) {
+		for (k = 0; k < NALGOS; k++) {
+			if (only != -1 && algos[k].a_algo != only)
+				continue;
+			if (bench_one(&corp[i], &algos[k], blksz, iters, warmup,
+			    &r))
+				continue;
+			bench_print(fmt, &corp[i], &r, first);
+			first = 0;
+		}
+		free(corp[i].c_data);
+	}
+	free(corp);
+
+	if (fmt == FMT_JSON)
+		printf("\n]\n");
+
+	return (0);
+}
+
+/*
+ * Scaling mode.  K threads, each with a private context and buffers, round
+ * trip blocks of a shared read only corpus for a fixed time.  Run for
+ * K = 1..N to see whether a backend, the allocator or shared state stops
+ * it from scaling across cores.
+ */
+struct scale {
+	struct algo		*s_algo;
+	const uint8_t		*s_data;
+	size_t			s_len;
+	size_t			s_bs;
+	int			s_id;
+	pthread_t		s_thread;
+	uint64_t		s_bytes;	/* round tripped */
+	double			s_comp_us;
+	double			s_decomp_us;
+};
+
+pthread_mutex_t			scale_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t			scale_cv = PTHREAD_COND_INITIALIZER;
+int				scale_go;
+int				scale_stop;	/* atomic, polled every block */
+
+int
+scale_running(void)
+{
+	return (!__atomic_load_n(&scale_stop, __ATOMIC_RELAXED));
+}
+
+void *
+scale_thread(void *arg)
+{
+	struct scale		*sc = arg;
+	struct shrink_ctx	*ctx;
+	uint8_t			*comp, *uncomp;
+	size_t			nblk, b, off, len, csz, usz, dsz;
+	uint64_t		bytes = 0;
+	double			t, comp_us = 0, decomp_us = 0;
+
+	if ((ctx = shrink_init(sc->s_algo->a_algo,
+	    sc->s_algo->a_level)) == NULL)
+		errx(1, "shrink_init");
+	dsz = sc->s_bs;
+	if ((comp = shrink_malloc(ctx, &dsz)) == NULL)
+		err(1, "shrink_malloc");
+	if ((uncomp = malloc(sc->s_bs)) == NULL)
+		err(1, "malloc");
+	nblk = (sc->s_len + sc->s_bs - 1) / sc->s_bs;
+
+	pthread_mutex_lock(&scale_mtx);
+	while (!scale_go)
+		pthread_cond_wait(&scale_cv, &scale_mtx);
+	pthread_mutex_unlock(&scale_mtx);
+
+	/* start at different blocks so threads do not run in lock step */
+	for (b = sc->s_id % nblk; scale_running(); b = (b + 1) % nblk) {
+		off = b * sc->s_bs;
+		len = MIN(sc->s_bs, sc->s_len - off);
+
+		csz = dsz;
+		t = now_us();
+		if (shrink_compress(ctx, (uint8_t *)sc->s_data + off, comp,
+		    len, &csz, NULL))
+			errx(1, "shrink_compress");
+		comp_us += now_us() - t;
+
+		usz = len;
+		t = now_us();
+		if (shrink_decompress(ctx, comp, uncomp, csz, &usz, NULL))
+			errx(1, "shrink_decompress");
+		decomp_us += now_us() - t;
+		if (usz != len)
+			errx(1, "data corruption");
+
+		bytes += len;
+	}
+	/* the results share cache lines, only write them once */
+	sc->s_bytes = bytes;
+	sc->s_comp_us = comp_us;
+	sc->s_decomp_us = decomp_us;
+
+	free(comp);
+	free(uncomp);
+	shrink_cleanup(ctx);
+
+	return (NULL);
+}
+
+/* returns the aggregate round trip throughput in MB/s */
+double
+scale_run(struct algo *a, const uint8_t *data, size_t len, size_t blksz,
+    int k, int secs, double base)
+{
+	struct scale		*sc;
+	struct timespec		ts;
+	double			start, wall, agg = 0, mbps;
+	int			i;
+
+	if ((sc = calloc(k, sizeof(*sc))) == NULL)
+		err(1, "calloc");
+
+	scale_go = 0;
+	__atomic_store_n(&scale_stop, 0, __ATOMIC_RELAXED);
+	for (i = 0; i < k; i++) {
+		sc[i].s_algo = a;
+		sc[i].s_data = data;
+		sc[i].s_len = len;
+		sc[i].s_bs = blksz;
+		sc[i].s_id = i;
+		if (pthread_create(&sc[i].s_thread, NULL, scale_thread, &sc[i]))
+			errx(1, "pthread_create");
+	}
+
+	pthread_mutex_lock(&scale_mtx);
+	scale_go = 1;
+	pthread_cond_broadcast(&scale_cv);
+	pthread_mutex_unlock(&scale_mtx);
+	start = now_us();
+
+	ts.tv_sec = secs;
+	ts.tv_nsec = 0;
+	while (nanosleep(&ts, &ts) == -1)
+		;
+	__atomic_store_n(&scale_stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < k; i++)
+		pthread_join(sc[i].s_thread, NULL);
+	wall = now_us() - start;
+
+	for (i = 0; i < k; i++) {
+		mbps = sc[i].s_bytes / wall;
+		agg += mbps;
+		printf("  thread %3d: %9.1f MB/s  compress %9.1f MB/s  "
+		    "decompress %9.1f MB/s\n", i, mbps,
+		    sc[i].s_bytes / (sc[i].s_comp_us ? sc[i].s_comp_us : 1),
+		    sc[i].s_bytes / (sc[i].s_decomp_us ?
+		    sc[i].s_decomp_us : 1));
+	}
+	printf("  %3d threads: aggregate %9.1f MB/s  efficiency %5.1f%%\n",
+	    k, agg, base ? agg * 100.0 / (k * base) : 100.0);
+	free(sc);
+
+	return (agg);
+}
+
+int
+scale_mode(int argc, char *argv[])
+{
+	struct shrink_ctx	*ctx;
+	uint8_t			*data;
+	uint64_t		st = 0x9e3779b97f4a7c15ULL;
+	size_t			blksz = 64 * 1024, len = 8 * 1024 * 1024;
+	double			base;
+	long			ncpu;
+	int			c, i, k, maxk, secs = 2, only = -1;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+	maxk = ncpu;
+
+	while ((c = getopt(argc, argv, "a:b:r:s:t:")) != -1) {
+		switch (c) {
+		case 'a':
+			only = parse_algo(optarg);
+			break;
+		case 'b':
+			blksz = atoi(optarg);
+			if (blksz <= 0 || blksz > 1024 * 1024 * 1024)
+				errx(1, "invalid block size");
+			break;
+		case 'r':
+			secs = atoi(optarg);
+			if (secs <= 0 || secs > 3600)
+				errx(1, "invalid duration");
+			break;
+		case 's':
+			len = atoi(optarg);
+			if (len <= 0 || len > 1024 * 1024 * 1024)
+				errx(1, "invalid corpus size");
+			break;
+		case 't':
+			maxk = atoi(optarg);
+			if (maxk <= 0 || maxk > 1024)
+				errx(1, "invalid number of threads");
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	if ((data = malloc(len)) == NULL)
+		err(1, "malloc");
+	gen_text(data, len, &st);
+
+	for (i = 0; i < NALGOS; i++) {
+		if (only != -1 && algos[i].a_algo != only)
+			continue;
+		if ((ctx = shrink_init(algos[i].a_algo,
+		    algos[i].a_level)) == NULL)
+			continue;
+		printf("%s%s\n", i && only == -1 ? "\n" : "",
+		    shrink_get_algorithm(ctx));
+		shrink_cleanup(ctx);
+
+		base = 0;
+		for (k = 1; k <= maxk; k++) {
+			if (k == 1)
+				base = scale_run(&algos[i], data, len, blksz,
+				    k, secs, 0);
+			else
+				scale_run(&algos[i], data, len, blksz, k, secs,
+				    base);
+		}
+	}
+	free(data);
+
+	return (0);
+}
+
 int
 main(int argc, char *argv[])
 {
-	int			c;
+	int			c, i;
 
-	while ((c = getopt(argc, argv, "b:c:f:r")) != -1) {
+	if (argc > 1 && !strcmp(argv[1], "compress"))
+		return (file_mode(MODE_COMPRESS, argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "decompress"))
+		return (file_mode(MODE_DECOMPRESS, argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+		return (bench_mode(argc - 1, argv + 1));
+	if (argc > 1 && !strcmp(argv[1], "scale"))
+		return (scale_mode(argc - 1, argv + 1));
+
+	while ((c = getopt(argc, argv, "b:c:f:H:imr")) != -1) {
 		switch (c) {
 		case 'b': /* block size */
 			bs = atoi(optarg);
@@ -304,11 +1625,22 @@ main(int argc, char *argv[])
 		case 'f':
 			filename = optarg;
 			break;
+		case 'H': /* chain blocks with this much history */
+			history = atoi(optarg);
+			if (history <= 0 || history > SHRINK_HIST_MAX)
+				errx(1, "invalid history size");
+			break;
+		case 'i': /* decompress in place */
+			inplace = 1;
+			break;
+		case 'm': /* mixed compressible and random data */
+			mixed_data = 1;
+			break;
 		case 'r':
 			random_data = 1;
 			break;
 		default:
-			errx(1, "invalid option");
+			usage();
 		}
 	}
 
@@ -317,25 +1649,11 @@ main(int argc, char *argv[])
 		exit(0);
 	}
 
-	test_run(SHRINK_ALG_NULL, SHRINK_L_NONE);
-	printf("\n");
-	test_run(SHRINK_ALG_LZO, SHRINK_L_MIN);
-	printf("\n");
-	test_run(SHRINK_ALG_LZO, SHRINK_L_MID);
-	printf("\n");
-	test_run(SHRINK_ALG_LZO, SHRINK_L_MAX);
-	printf("\n");
-	test_run(SHRINK_ALG_LZW, SHRINK_L_MIN);
-	printf("\n");
-	test_run(SHRINK_ALG_LZW, SHRINK_L_MID);
-	printf("\n");
-	test_run(SHRINK_ALG_LZW, SHRINK_L_MAX);
-	printf("\n");
-	test_run(SHRINK_ALG_LZMA, SHRINK_L_MIN);
-	printf("\n");
-	test_run(SHRINK_ALG_LZMA, SHRINK_L_MID);
-	printf("\n");
-	test_run(SHRINK_ALG_LZMA, SHRINK_L_MAX);
+	for (i = 0; i < NALGOS; i++) {
+		if (i)
+			printf("\n");
+		test_run(algos[i].a_algo, algos[i].a_level);
+	}
 
 	return (0);
 }